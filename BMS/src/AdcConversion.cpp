@@ -0,0 +1,61 @@
+#include "AdcConversion.h"
+
+#include "BmsConfig.h"
+
+using namespace std::chrono;
+
+// Conversion times in microseconds, indexed by the MD bits of the command
+// (0: 422Hz/1kHz, 1: 27kHz/14kHz, 2: 7kHz/3kHz, 3: 26Hz/2kHz) and then by
+// ADCOPT. These are the datasheet figures, the margin on top comes from
+// conversionTimeout().
+static constexpr uint32_t cellVoltageTimes[4][2] = {
+    {12807, 7173}, {1113, 1288}, {2335, 3033}, {201317, 4407}};
+// Sum of cells adds about a tenth to the cell conversion
+static constexpr uint32_t cellVoltageSumTimes[4][2] = {
+    {14180, 7950}, {1230, 1425}, {2585, 3360}, {223000, 4882}};
+static constexpr uint32_t gpioSingleTimes[4][2] = {
+    {2120, 1194}, {201, 230}, {405, 501}, {34005, 754}};
+static constexpr uint32_t gpioAllTimes[4][2] = {
+    {12807, 7173}, {1113, 1288}, {2335, 3033}, {201317, 4407}};
+
+static_assert(isValidAdcRate(BMS_ADC_RATE_DRIVING), "Invalid BMS_ADC_RATE_DRIVING");
+static_assert(isValidAdcRate(BMS_ADC_RATE_CHARGING), "Invalid BMS_ADC_RATE_CHARGING");
+static_assert(isValidAdcRate(BMS_ADC_RATE_TEMPERATURE), "Invalid BMS_ADC_RATE_TEMPERATURE");
+
+AdcSettings selectAdcSettings(AdcPurpose purpose, bool charging) {
+  switch (purpose) {
+    case AdcPurpose::kSelfTest:
+    case AdcPurpose::kOpenWire:
+      return adcSettingsForRate(7000);
+    case AdcPurpose::kCellVoltage:
+      return adcSettingsForRate(charging ? BMS_ADC_RATE_CHARGING : BMS_ADC_RATE_DRIVING);
+    case AdcPurpose::kTemperature:
+      return adcSettingsForRate(BMS_ADC_RATE_TEMPERATURE);
+    case AdcPurpose::kPackVoltage:
+    case AdcPurpose::kVoltageFlags:
+      // Only run between full scans to keep up with the pack, so always fast
+      return adcSettingsForRate(BMS_ADC_RATE_DRIVING);
+  }
+  return adcSettingsForRate(7000);
+}
+
+microseconds conversionTime(AdcConversion conversion, AdcMode mode,
+                            LTC6811::AdcModeOption adcOption) {
+  uint8_t md = (uint8_t)mode & 0b11;
+  uint8_t opt = (uint8_t)adcOption & 0b1;
+
+  switch (conversion) {
+    case AdcConversion::kCellVoltage:
+      return microseconds(cellVoltageTimes[md][opt]);
+    case AdcConversion::kCellVoltageSum:
+      return microseconds(cellVoltageSumTimes[md][opt]);
+    case AdcConversion::kCellPair:
+    case AdcConversion::kGpioSingle:
+    case AdcConversion::kSumOfCells:
+      // Single channel conversions all take the same time
+      return microseconds(gpioSingleTimes[md][opt]);
+    case AdcConversion::kGpioAll:
+      return microseconds(gpioAllTimes[md][opt]);
+  }
+  return microseconds(cellVoltageTimes[md][opt]);
+}
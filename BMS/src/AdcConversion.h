@@ -0,0 +1,146 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "mbed.h"
+#include "rtos.h"
+
+#include "LTC681xCommand.h"
+#include "LTC6811.h"
+
+// Conversions started by the BMS, for looking up how long they take
+enum class AdcConversion {
+    // ADCV or CVST on all cells
+    kCellVoltage,
+    // ADCVSC, all cells and the sum of cells
+    kCellVoltageSum,
+    // ADCV on one CH selection, e.g. cells 1 and 7
+    kCellPair,
+    // ADAX on a single GPIO
+    kGpioSingle,
+    // ADAX or AXST on all GPIOs and the second reference
+    kGpioAll,
+    // ADSTAT on the sum of cells only
+    kSumOfCells
+};
+
+// What a conversion is for, which decides the sample rate
+enum class AdcPurpose {
+    // Datasheet self test codes are given for 7kHz
+    kSelfTest,
+    // Full scan of cell voltages, rate depends on whether the car is charging
+    kCellVoltage,
+    // Thermistor mux scan
+    kTemperature,
+    // Sum of cells between full scans
+    kPackVoltage,
+    // Cell conversion between full scans, only for the OV/UV comparators
+    kVoltageFlags,
+    // ADOW open wire check, the datasheet procedure is given for 7kHz
+    kOpenWire
+};
+
+// Command mode bits and ADCOPT configuration bit for one sample rate
+struct AdcSettings {
+    AdcMode mode;
+    LTC6811::AdcModeOption option;
+};
+
+constexpr bool isValidAdcRate(uint32_t rate) {
+    return rate == 27000 || rate == 14000 || rate == 7000 || rate == 3000 ||
+           rate == 2000 || rate == 1000 || rate == 422 || rate == 26;
+}
+
+// rate: one of the rates accepted by isValidAdcRate(), in hertz
+constexpr AdcSettings adcSettingsForRate(uint32_t rate) {
+    switch (rate) {
+        case 27000: return {AdcMode::k27k, LTC6811::AdcModeOption::kDefault};
+        case 14000: return {AdcMode::k14k, LTC6811::AdcModeOption::kLowSpeed};
+        case 3000: return {AdcMode::k3k, LTC6811::AdcModeOption::kLowSpeed};
+        case 2000: return {AdcMode::k2k, LTC6811::AdcModeOption::kLowSpeed};
+        case 1000: return {AdcMode::k1k, LTC6811::AdcModeOption::kLowSpeed};
+        case 422: return {AdcMode::k422, LTC6811::AdcModeOption::kDefault};
+        case 26: return {AdcMode::k26, LTC6811::AdcModeOption::kDefault};
+        default: return {AdcMode::k7k, LTC6811::AdcModeOption::kDefault};
+    }
+}
+
+// Code every channel reads back after a self test conversion (CVST, AXST),
+// from the digital filter table of the LTC6811 datasheet
+constexpr uint16_t selfTestCode(AdcMode mode, LTC6811::AdcModeOption option,
+                                SelfTestMode test) {
+    bool second = test == SelfTestMode::kSelfTest2;
+    if (((uint8_t)mode & 0b11) == 1) {
+        if (option == LTC6811::AdcModeOption::kDefault) {
+            // 27kHz
+            return second ? 0x6A9A : 0x9565;
+        }
+        // 14kHz
+        return second ? 0x6AAC : 0x9553;
+    }
+    return second ? 0x6AAA : 0x9555;
+}
+
+// Sample rate to use for a conversion, from the BMS_ADC_RATE_* settings
+AdcSettings selectAdcSettings(AdcPurpose purpose, bool charging);
+
+// Conversion time (tCONV) from the LTC6811 datasheet
+//
+// adcOption selects between the two sample rates that share each AdcMode,
+// e.g. 27kHz (kDefault) or 14kHz (kLowSpeed)
+std::chrono::microseconds conversionTime(AdcConversion conversion, AdcMode mode,
+                                         LTC6811::AdcModeOption adcOption);
+
+// Conversion time on a given monitor variant. The LTC6812 and LTC6813 put
+// more channels on each ADC, which stretches the conversions of all channels.
+template <typename Variant>
+std::chrono::microseconds conversionTime(AdcConversion conversion, AdcMode mode,
+                                         LTC6811::AdcModeOption adcOption) {
+    auto time = conversionTime(conversion, mode, adcOption);
+    switch (conversion) {
+        case AdcConversion::kCellVoltage:
+        case AdcConversion::kCellVoltageSum:
+            return time * Variant::kCellsPerAdc / LTC6811Variant::kCellsPerAdc;
+        case AdcConversion::kGpioAll:
+            return time * Variant::kAuxChannels / LTC6811Variant::kAuxChannels;
+        default:
+            return time;
+    }
+}
+
+// How long past the expected conversion time to keep polling before giving up
+inline std::chrono::microseconds conversionTimeout(std::chrono::microseconds expected) {
+    return expected / 4 + std::chrono::microseconds(100);
+}
+
+// Block until a conversion that was just started has completed
+//
+// Sleeps through the bulk of the expected conversion time, then calls isDone
+// until it returns true or the conversion timeout has passed.
+//
+// isDone: poll the chips, returning true once the conversion is done
+// returns: false on timeout
+template <typename F>
+bool waitForConversion(std::chrono::microseconds expected, F isDone) {
+    Timer timer;
+    timer.start();
+
+    // RTOS sleeps only have millisecond resolution, spin for the rest
+    auto sleepTime = std::chrono::duration_cast<std::chrono::milliseconds>(expected);
+    if (sleepTime.count() > 0) {
+        ThisThread::sleep_for(sleepTime);
+    }
+    auto elapsed = timer.elapsed_time();
+    if (elapsed < expected) {
+        wait_us((expected - elapsed).count());
+    }
+
+    auto deadline = expected + conversionTimeout(expected);
+    while (!isDone()) {
+        if (timer.elapsed_time() >= deadline) {
+            return false;
+        }
+    }
+    return true;
+}
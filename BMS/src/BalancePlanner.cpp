@@ -0,0 +1,149 @@
+#include "BalancePlanner.h"
+
+#include <algorithm>
+
+// Allowance left between where derating starts and where balancing stops
+//
+// Units: per mille
+static unsigned int derate(int temperature, int start, int limit) {
+  if (temperature <= start) {
+    return 1000;
+  }
+  if (temperature >= limit) {
+    return 0;
+  }
+  return (unsigned int)(limit - temperature) * 1000 / (limit - start);
+}
+
+// Length of the run of adjacent pins through pin, C1 in the LSB
+static unsigned int runLength(uint32_t pins, unsigned int pin) {
+  unsigned int length = 1;
+  for (unsigned int i = pin + 1; i < 32 && (pins & (1u << i)); i++) {
+    length++;
+  }
+  for (unsigned int i = pin; i > 0 && (pins & (1u << (i - 1))); i--) {
+    length++;
+  }
+  return length;
+}
+
+void BalancePlanner::update(const PackSnapshot &snapshot, bool allowed,
+                            Kernel::Clock::time_point now, uint32_t *masks) {
+  uint32_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_lastUpdate).count();
+  m_lastUpdate = now;
+
+  if (!allowed) {
+    std::fill(std::begin(m_remaining), std::end(m_remaining), 0);
+    std::fill(std::begin(m_masks), std::end(m_masks), 0);
+    std::fill(masks, masks + BMS_BANK_COUNT, 0);
+    // Plan again straight away once allowed
+    m_nextPlan = now;
+    return;
+  }
+
+  // Count down what the cells bled since the last update
+  for (unsigned int bank = 0; bank < BMS_BANK_COUNT; bank++) {
+    for (unsigned int pin = 0; pin < 32 && (m_masks[bank] >> pin); pin++) {
+      if (m_masks[bank] & (1u << pin)) {
+        uint32_t &remaining = m_remaining[kPackTopology.cellIndex(bank, pin)];
+        remaining -= std::min(remaining, elapsed);
+      }
+    }
+  }
+
+  // The target comes from the lowest cell, which is only known once every
+  // bank has been read in the same scan. Until then the old plan carries on.
+  if (now >= m_nextPlan && snapshot.staleVoltageBanks == 0) {
+    plan(snapshot);
+    m_nextPlan = now + std::chrono::milliseconds(BMS_BALANCE_PLAN_PERIOD);
+  }
+
+  for (unsigned int bank = 0; bank < BMS_BANK_COUNT; bank++) {
+    uint32_t pins = kPackTopology.cellPins(bank);
+    unsigned int cells = kPackTopology.cellCount(bank);
+    unsigned int allowance = thermalAllowance(snapshot, bank);
+    unsigned int budget = cells * allowance / 1000;
+    // Fewer neighbours at once as soon as the bank has to be derated
+    unsigned int maxRun = allowance >= 1000 ? BMS_BALANCE_MAX_ADJACENT : 1;
+
+    // Most bleed time left first, skipping cells that would make too long a
+    // run of neighbours
+    uint32_t mask = 0;
+    uint32_t considered = 0;
+    // Nothing bleeds on a bank that can't be read
+    if (snapshot.staleVoltageBanks & (1u << bank)) {
+      budget = 0;
+    }
+    for (unsigned int picked = 0; picked < budget;) {
+      unsigned int best = 32;
+      uint32_t bestRemaining = 0;
+      for (unsigned int pin = 0; pin < 32; pin++) {
+        if (!(pins & ~considered & (1u << pin))) {
+          continue;
+        }
+        uint32_t remaining = m_remaining[kPackTopology.cellIndex(bank, pin)];
+        if (remaining > bestRemaining) {
+          best = pin;
+          bestRemaining = remaining;
+        }
+      }
+      if (best == 32) {
+        break;
+      }
+
+      considered |= 1u << best;
+      if (runLength(mask | (1u << best), best) <= maxRun) {
+        mask |= 1u << best;
+        picked++;
+      }
+    }
+
+    m_masks[bank] = mask;
+    masks[bank] = mask;
+  }
+}
+
+void BalancePlanner::plan(const PackSnapshot &snapshot) {
+  // A cell with an open wire reads nothing like its real voltage, it neither
+  // sets the target nor bleeds
+  uint16_t target = UINT16_MAX;
+  for (unsigned int cell = 0; cell < BMS_CELL_COUNT; cell++) {
+    if (!(snapshot.cellHealth[cell] & PackSnapshot::kOpenWire)) {
+      target = std::min(target, snapshot.cellVoltages[cell]);
+    }
+  }
+
+  for (unsigned int cell = 0; cell < BMS_CELL_COUNT; cell++) {
+    uint16_t voltage = snapshot.cellVoltages[cell];
+    if (snapshot.cellHealth[cell] & PackSnapshot::kOpenWire) {
+      m_remaining[cell] = 0;
+      continue;
+    }
+    // Only start above the thresholds, but a cell that is already bleeding
+    // carries on all the way down
+    bool start = voltage >= BMS_BALANCE_THRESHOLD && voltage >= target + BMS_DISCHARGE_THRESHOLD;
+    if (voltage <= target || (!start && m_remaining[cell] == 0)) {
+      m_remaining[cell] = 0;
+      continue;
+    }
+
+    // Excess charge over the balancing current, I = V / R
+    uint64_t charge = (uint64_t)(voltage - target) * BMS_BALANCE_CHARGE_PER_MV;
+    m_remaining[cell] = (uint32_t)(charge * BMS_BALANCE_RESISTOR * 1000 / voltage);
+  }
+}
+
+unsigned int BalancePlanner::thermalAllowance(const PackSnapshot &snapshot, unsigned int bank) {
+  // Without this scan's temperatures there is nothing to derate from
+  if (snapshot.staleTemperatureBanks & (1u << bank)) {
+    return 0;
+  }
+  int bankTemperature = INT8_MIN;
+  for (int8_t temperature : snapshot.bankTemperatures(bank)) {
+    bankTemperature = std::max<int>(bankTemperature, temperature);
+  }
+
+  return std::min(derate(bankTemperature, BMS_BALANCE_TEMP_DERATE, BMS_BALANCE_TEMP_LIMIT),
+                  derate(snapshot.dieTemperatures[bank], BMS_BALANCE_DIE_TEMP_DERATE,
+                         BMS_BALANCE_DIE_TEMP_LIMIT));
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "mbed.h"
+
+#include "BmsConfig.h"
+#include "PackSnapshot.h"
+
+// Decides which cells bleed, scan by scan
+//
+// Every BMS_BALANCE_PLAN_PERIOD, each cell above the lowest one is given the
+// bleed time it needs to come down to it, from its excess voltage, the charge
+// per millivolt of a cell and its balancing current. Bleeding counts that
+// time down, so a cell bleeds until its plan is done instead of toggling
+// around a threshold.
+//
+// Each scan, the cells with the most bleed time left go first, which gets
+// the whole pack balanced soonest. How many cells of a bank may bleed, and
+// how many neighbouring ones at once, is limited by the hottest thermistor
+// of the bank and the die temperature of its monitor.
+//
+// Only a scan that read every bank gets planned from, and a bank whose
+// voltages or temperatures weren't read in the last scan doesn't bleed.
+class BalancePlanner {
+public:
+    // Plan the discharge state of every bank for the next scan
+    //
+    // snapshot: latest measurements, including the die temperatures
+    // allowed: whether balancing is allowed at all, forgets the plan if not
+    // masks: set to the cell pins to discharge per bank, C1 in the LSB
+    void update(const PackSnapshot& snapshot, bool allowed, Kernel::Clock::time_point now,
+                uint32_t* masks);
+
+private:
+    // Bleed time left per cell in pack order
+    //
+    // Units: milliseconds
+    uint32_t m_remaining[BMS_CELL_COUNT] = {};
+    // Discharge state handed out by the last update, bank by bank
+    uint32_t m_masks[BMS_BANK_COUNT] = {};
+    Kernel::Clock::time_point m_lastUpdate;
+    Kernel::Clock::time_point m_nextPlan;
+
+    void plan(const PackSnapshot& snapshot);
+
+    // Share of a bank's cells that may bleed, from 0 (none) to 1 (all)
+    //
+    // Units: per mille
+    static unsigned int thermalAllowance(const PackSnapshot& snapshot, unsigned int bank);
+};
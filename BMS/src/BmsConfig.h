@@ -2,6 +2,11 @@
 
 #include "mbed.h"
 
+#include <array>
+#include <cstdint>
+
+#include "PackTopology.h"
+
 // Global pointer to can bus object
 //
 // This allows for all files to access the can bus output
@@ -17,19 +22,176 @@ extern DigitalOut* chargerControl;
 // BMS Master Configuration
 //
 
-// Number of LTC6811 battery banks to communicate with
-#ifndef BMS_BANK_COUNT
-#define BMS_BANK_COUNT 5
+// Battery monitor used on every bank: 6811, 6812 or 6813
+//
+// The LTC6812 (15 cells) and LTC6813 (18 cells) only come as daisy chain
+// parts and need BMS_ISOSPI_CHAIN. kPackTopology may use their extra pins.
+#ifndef BMS_MONITOR
+#define BMS_MONITOR 6811
+#endif
+
+// isoSPI topology of the LTC6811 banks
+//
+// 0: LTC6811-2 on a parallel bus, every chip addressed individually
+// 1: LTC6811-1 on a daisy chain, each register group of every chip read back
+//    in a single transaction
+#ifndef BMS_ISOSPI_CHAIN
+#define BMS_ISOSPI_CHAIN 0
+#endif
+
+// Number of daisy chains the banks are split over, each on its own SPI
+// peripheral. Conversions are started on every chain at once, so scan time
+// does not grow with the number of chains. Only used with BMS_ISOSPI_CHAIN.
+#ifndef BMS_ISOSPI_CHAIN_COUNT
+#define BMS_ISOSPI_CHAIN_COUNT 1
+#endif
+
+// Cell conversion mode
+//
+// 1: convert cell voltages and the sum of cells in one run (ADCVSC), giving a
+//    measured pack voltage at no extra conversion time
+// 0: convert cell voltages only (ADCV), pack voltage is summed from the cells
+#ifndef BMS_COMBINED_CONVERSION
+#define BMS_COMBINED_CONVERSION 1
+#endif
+
+// ADC sample rates, picked per operating mode
+//
+// One of 27000, 14000, 7000, 3000, 2000, 1000, 422 or 26. Faster rates have
+// less filtering and more noise. The ADCOPT configuration bit and wait times
+// follow from the rate.
+//
+// Units: hertz
+
+// Cell voltages while driving, fast to catch transients under load
+#ifndef BMS_ADC_RATE_DRIVING
+#define BMS_ADC_RATE_DRIVING 27000
+#endif
+
+// Cell voltages while charging, filtered for accurate balancing decisions
+#ifndef BMS_ADC_RATE_CHARGING
+#define BMS_ADC_RATE_CHARGING 26
+#endif
+
+// Thermistors, which change slowly but sit behind a mux
+#ifndef BMS_ADC_RATE_TEMPERATURE
+#define BMS_ADC_RATE_TEMPERATURE 7000
+#endif
+
+// Times a register group is read again on a chip whose read failed, before
+// its last good value is kept
+#ifndef BMS_READ_RETRY_LIMIT
+#define BMS_READ_RETRY_LIMIT 2
+#endif
+
+// Most register group retries in one scan, so a bad link can't stretch the
+// scan much past its normal length
+#ifndef BMS_READ_RETRY_BUDGET
+#define BMS_READ_RETRY_BUDGET 8
+#endif
+
+// Full scans in a row a bank's cells or thermistors may go unread, keeping
+// the values of an older scan, before the BMS faults. Past this the old
+// values could be hiding a cell drifting out of range.
+#ifndef BMS_STALE_SCAN_LIMIT
+#define BMS_STALE_SCAN_LIMIT 3
+#endif
+
+// Temperature mux scan mode
+//
+// 1: step the thermistor mux of every bank together and convert GPIO4 on all
+//    chips at once, so scan time only depends on the number of mux channels
+// 0: scan every bank on its own, with the banks interleaved by ScanExecutor so
+//    one chip converts while the others are written to or read back (not
+//    supported on a daisy chain). Only worth it if the mux channels of the
+//    banks can't be stepped together.
+#ifndef BMS_TEMP_SCAN_BROADCAST
+#define BMS_TEMP_SCAN_BROADCAST 1
+#endif
+
+// Period of the sum of cells pack voltage measurement run between full scans,
+// 0 to disable
+//
+// Units: milliseconds
+#ifndef BMS_PACK_VOLTAGE_PERIOD
+#define BMS_PACK_VOLTAGE_PERIOD 20
+#endif
+
+// Largest difference between the fast pack voltage and the cell sum of the
+// last full scan before the fast reading is flagged as implausible
+//
+// Units: millivolts
+#ifndef BMS_PACK_VOLTAGE_TOLERANCE
+#define BMS_PACK_VOLTAGE_TOLERANCE 5000
 #endif
 
-// Number of cell voltage readings per LTC6811
-#ifndef BMS_BANK_CELL_COUNT
-#define BMS_BANK_CELL_COUNT 6
+// Period of the hardware cell voltage check run between full scans, 0 to
+// disable
+//
+// Every chip compares its cells against BMS_FAULT_VOLTAGE_THRESHOLD_HIGH/LOW
+// in hardware as part of a cell conversion, so a check is one fast conversion
+// and a read of the status flags. A flagged cell starts a full scan right
+// away instead of waiting for the next one.
+//
+// Units: milliseconds
+#ifndef BMS_VOLTAGE_FLAG_PERIOD
+#define BMS_VOLTAGE_FLAG_PERIOD 10
 #endif
 
-// Number of cell temperature readings per LTC6811
-#ifndef BMS_BANK_TEMP_COUNT
-#define BMS_BANK_TEMP_COUNT BMS_BANK_CELL_COUNT
+// Time to check every cell input for an open wire (ADOW) once, 0 to disable
+//
+// The check runs in steps between the fast paths of BMS_PACK_VOLTAGE_PERIOD
+// and BMS_VOLTAGE_FLAG_PERIOD, one bank at a time (all at once on a daisy
+// chain), and only when the bus is free long enough for one of its steps.
+// Results end up in PackSnapshot::cellHealth.
+//
+// Units: milliseconds
+#ifndef BMS_OPEN_WIRE_PERIOD
+#define BMS_OPEN_WIRE_PERIOD 1000
+#endif
+
+// Time to run every background self test once (cell and GPIO self test, ADC
+// overlap and mux diagnostic), 0 to only run them once at startup
+//
+// The tests are spread over the period and run on every chip at once, in the
+// same free bus time as the open wire check. Results are published per chip
+// in BmsEvent::diagnostics.
+//
+// Units: milliseconds
+#ifndef BMS_SELF_TEST_PERIOD
+#define BMS_SELF_TEST_PERIOD 1000
+#endif
+
+// Period of the full scan while the car is parked (MainToBMSEvent::parked)
+//
+// Nothing runs between parked scans except the hardware cell voltage check
+// below, so the chips can power down their reference and isoSPI ports. Main
+// turns off stdin while parked, which leaves the MCU free to deep sleep unless
+// some other driver holds a lock (CAN RX will, once it is attached again).
+// Build with MBED_SLEEP_TRACING_ENABLED to list the locks that are held.
+// Main ending parked mode starts a full scan straight away.
+//
+// Units: milliseconds
+#ifndef BMS_PARKED_SCAN_PERIOD
+#define BMS_PARKED_SCAN_PERIOD 10000
+#endif
+
+// Period of the hardware cell voltage check while parked, 0 to disable
+//
+// Keep this under the 1.8s watchdog timeout of the chips, or every check has
+// to rewrite the comparator thresholds after the chips went to sleep.
+//
+// Units: milliseconds
+#ifndef BMS_PARKED_VOLTAGE_FLAG_PERIOD
+#define BMS_PARKED_VOLTAGE_FLAG_PERIOD 1000
+#endif
+
+// Loop period of main while parked, which bounds how long a wake condition
+// takes to reach the BMS thread
+//
+// Units: milliseconds
+#ifndef BMS_PARKED_MAIN_PERIOD
+#define BMS_PARKED_MAIN_PERIOD 100
 #endif
 
 // Upper threshold when fault will be thrown for cell temperature
@@ -82,6 +244,73 @@ extern DigitalOut* chargerControl;
 #define BMS_BALANCE_THRESHOLD 3900
 #endif
 
+// Keep balancing through cell conversions
+//
+// 1: discharge stays on while the cells are converted, and the cell readings
+//    are corrected for the drops of the balancing currents across the sense
+//    wires (see kBalanceDropResistance). Discharging cells read low, and their
+//    neighbours on a shared wire read high. Only the cell registers are
+//    corrected. The OV/UV comparators judge the uncorrected conversions, so a
+//    flag may come a few millivolts early or late, and the software re-read
+//    of a flagged cell decides. In BMS_COMBINED_CONVERSION the sum of cells
+//    converts with discharge on too. The drops on the wires shared inside a
+//    bank cancel out of it, but those on the lowest and highest wire of a
+//    discharging end cell don't, and the sum isn't corrected for them.
+// 0: discharge is switched off and the cells left to settle before every
+//    scan, then switched back on after it
+#ifndef BMS_BALANCE_DURING_MEASUREMENT
+#define BMS_BALANCE_DURING_MEASUREMENT 1
+#endif
+
+// Balance resistor of each cell
+//
+// Units: ohms
+#ifndef BMS_BALANCE_RESISTOR
+#define BMS_BALANCE_RESISTOR 33
+#endif
+
+// How often the balancing plan is worked out again from fresh cell voltages
+//
+// Units: milliseconds
+#ifndef BMS_BALANCE_PLAN_PERIOD
+#define BMS_BALANCE_PLAN_PERIOD 30000
+#endif
+
+// Charge that lowers a cell's voltage by one millivolt in the range it is
+// balanced in, from the cell capacity and the slope of its OCV curve
+//
+// Units: milliamp seconds per millivolt
+#ifndef BMS_BALANCE_CHARGE_PER_MV
+#define BMS_BALANCE_CHARGE_PER_MV 10800
+#endif
+
+// Most neighbouring cells of a bank that may bleed at once, their resistors
+// sit next to each other on the board. Drops to 1 once the bank is derated.
+#ifndef BMS_BALANCE_MAX_ADJACENT
+#define BMS_BALANCE_MAX_ADJACENT 2
+#endif
+
+// Hottest thermistor of a bank where fewer of its cells may bleed, and where
+// none may
+//
+// Units: degrees celcius
+#ifndef BMS_BALANCE_TEMP_DERATE
+#define BMS_BALANCE_TEMP_DERATE 40
+#endif
+#ifndef BMS_BALANCE_TEMP_LIMIT
+#define BMS_BALANCE_TEMP_LIMIT 55
+#endif
+
+// Same for the die temperature of the monitor
+//
+// Units: degrees celcius
+#ifndef BMS_BALANCE_DIE_TEMP_DERATE
+#define BMS_BALANCE_DIE_TEMP_DERATE 70
+#endif
+#ifndef BMS_BALANCE_DIE_TEMP_LIMIT
+#define BMS_BALANCE_DIE_TEMP_LIMIT 95
+#endif
+
 // highest power allowed
 #ifndef CAR_MAX_POWER
 #define CAR_MAX_POWER 80000
@@ -117,11 +346,46 @@ extern DigitalOut* chargerControl;
 #endif
 
 
-// BMS Cell lookup
+// Pack topology
 //
-// This defines the mapping from LTC6811 pins to cell indicies.
-// Values of -1 indicate the pin is not connected.
-const int BMS_CELL_MAP[12] = {0, 1, 2, -1, -1, -1, 3, 4, 5, -1, -1, -1};
+// One entry per battery bank, in the order the banks sit on the bus: the
+// monitor cell pins with a cell connected (C1 in the LSB) and the number of
+// thermistor mux channels in use. Banks may differ from each other.
+inline constexpr PackTopology<5> kPackTopology{{{
+    {0b000111000111, 6},
+    {0b000111000111, 6},
+    {0b000111000111, 6},
+    {0b000111000111, 6},
+    {0b000111000111, 6},
+}}};
+
+static_assert(kPackTopology.isValid(),
+              "Every bank needs a cell, and the mux only has 8 channels");
+
+// Number of battery banks (monitor chips) to communicate with
+constexpr int BMS_BANK_COUNT = kPackTopology.bankCount();
+
+// Number of cell voltage readings in the pack
+constexpr int BMS_CELL_COUNT = kPackTopology.totalCells();
+
+// Number of cell temperature readings in the pack
+constexpr int BMS_TEMP_COUNT = kPackTopology.totalThermistors();
+
+static_assert(BMS_TEMP_COUNT > 0, "The pack needs at least one thermistor");
+
+// Resistance in the path of each cell's balancing current that is also in its
+// measurement path, i.e. both sense wires and their connections, in pack
+// order. The default is the same for every cell, replace it with measured
+// values where cells differ.
+//
+// Units: milliohms
+inline constexpr std::array<uint16_t, BMS_CELL_COUNT> kBalanceDropResistance = [] {
+    std::array<uint16_t, BMS_CELL_COUNT> resistance{};
+    for (uint16_t& cell : resistance) {
+        cell = 50;
+    }
+    return resistance;
+}();
 
 
 //
@@ -350,6 +614,59 @@ const int BMS_CELL_MAP[12] = {0, 1, 2, -1, -1, -1, 3, 4, 5, -1, -1, -1};
 
 #endif
 
+// Second SPI peripheral, for the second daisy chain
+//
+// The LPC1768 has its second SPI peripheral on p11 to p13, which are free
+// here. On the Nucleo boards every other SPI pin mapping clashes with a pin
+// in use, so there these have to be given for the board in use.
+
+// Second SPI master out slave in
+#ifndef BMS_PIN_SPI2_MOSI
+
+#ifdef TARGET_LPC1768
+  #define BMS_PIN_SPI2_MOSI p11
+#endif
+
+#endif
+
+// Second SPI master in slave out
+#ifndef BMS_PIN_SPI2_MISO
+
+#ifdef TARGET_LPC1768
+  #define BMS_PIN_SPI2_MISO p12
+#endif
+
+#endif
+
+// Second SPI clock
+#ifndef BMS_PIN_SPI2_SCLK
+
+#ifdef TARGET_LPC1768
+  #define BMS_PIN_SPI2_SCLK p13
+#endif
+
+#endif
+
+// Second SPI chip select
+#ifndef BMS_PIN_SPI2_SSEL
+
+#ifdef TARGET_LPC1768
+  #define BMS_PIN_SPI2_SSEL p14
+#endif
+
+#endif
+
+#if BMS_ISOSPI_CHAIN && BMS_ISOSPI_CHAIN_COUNT > 1
+#if !defined(BMS_PIN_SPI2_MOSI) || !defined(BMS_PIN_SPI2_MISO) || \
+    !defined(BMS_PIN_SPI2_SCLK) || !defined(BMS_PIN_SPI2_SSEL)
+  #error "BMS_PIN_SPI2_* must be defined for BMS_ISOSPI_CHAIN_COUNT > 1"
+#endif
+#endif
+
+#if BMS_ISOSPI_CHAIN_COUNT < 1 || BMS_ISOSPI_CHAIN_COUNT > 2
+  #error "BMS_ISOSPI_CHAIN_COUNT must be 1 or 2"
+#endif
+
 
 //
 // CAN Configuration
@@ -6,95 +6,172 @@
 #include <algorithm>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 
 #include "EnergusTempSensor.h"
+#include "PackReduction.h"
+#include "Pec15.h"
 
-BMSThread::BMSThread(LTC681xBus &bus, unsigned int frequency, BmsEventMailbox* bmsEventMailbox, MainToBMSMailbox* mainToBMSMailbox)
-    : m_bus(bus), bmsEventMailbox(bmsEventMailbox), mainToBMSMailbox(mainToBMSMailbox) {
-  for (int i = 0; i < BMS_BANK_COUNT; i++) {
-    m_chips.push_back(LTC6811(bus, i));
-  }
-  for (int i = 0; i < BMS_BANK_COUNT; i++) {
-    // m_chips[i].getConfig().gpio5 = LTC6811::GPIOOutputState::kLow;
-    // m_chips[i].getConfig().gpio4 = LTC6811::GPIOOutputState::kPassive;
+// Daisy chain start command frames with their PEC, built at compile time. One
+// frame per ADC mode, indexed by the MD bits.
+using ModeFrames = std::array<CommandFrame, 4>;
 
-    m_chips[i].updateConfig();
-  }
+template <typename F>
+static constexpr ModeFrames framesForModes(F build) {
+  return {makeCommandFrame(build((AdcMode)0)), makeCommandFrame(build((AdcMode)1)),
+          makeCommandFrame(build((AdcMode)2)), makeCommandFrame(build((AdcMode)3))};
 }
 
-void BMSThread::threadWorker() {
-  printf("BMS threadWorker()\n");
-  // Perform self tests
-
-  // Cell Voltage self test
-  m_bus.WakeupBus();
-  m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
-      StartSelfTestCellVoltage(AdcMode::k7k, SelfTestMode::kSelfTest1)));
-  ThisThread::sleep_for(4ms);
-  m_bus.WakeupBus();
-  printf("BMS A\n");
-  for (int i = 0; i < BMS_BANK_COUNT; i++) {
-    uint16_t rawVoltages[12];
+static constexpr ModeFrames kSelfTestCellVoltageFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartSelfTestCellVoltage(mode, SelfTestMode::kSelfTest1);
+});
+static constexpr ModeFrames kSelfTestGpioFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartSelfTestGpio(mode, SelfTestMode::kSelfTest1);
+});
+// Cell conversions leave balancing on if the discharge drop is corrected for
+static constexpr bool kDischargePermitted = BMS_BALANCE_DURING_MEASUREMENT;
 
-    if (m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupA(), i),
-            (uint8_t *)rawVoltages) != LTC681xBus::LTC681xBusStatus::Ok) {
-      printf("Things are not okay. SelfTestVoltageA\n");
-    }
-    if (m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupB(), i),
-            (uint8_t *)rawVoltages + 6) != LTC681xBus::LTC681xBusStatus::Ok) {
-      printf("Things are not okay. SelfTestVoltageB\n");
-    }
-    if (m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupC(), i),
-            (uint8_t *)rawVoltages + 12) != LTC681xBus::LTC681xBusStatus::Ok) {
-      printf("Things are not okay. SelfTestVoltageC\n");
+static constexpr ModeFrames kCellVoltageFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartCellVoltageADC(mode, kDischargePermitted, CellSelection::kAll);
+});
+static constexpr ModeFrames kCellVoltageSumFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartCombinedCellVoltageSumADC(mode, kDischargePermitted);
+});
+static constexpr ModeFrames kThermistorFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartGpioADC(mode, GpioSelection::k4);
+});
+static constexpr ModeFrames kSumOfCellsFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartStatusADC(mode, StatusGroupSelection::kSC);
+});
+static constexpr ModeFrames kDieTemperatureFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartStatusADC(mode, StatusGroupSelection::kITMP);
+});
+static constexpr ModeFrames kOverlapFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartOverlapMeasurement(mode, false);
+});
+static constexpr ModeFrames kDiagnoseMuxFrames = {
+    LTC6811ChainBus::kDiagnoseMux, LTC6811ChainBus::kDiagnoseMux, LTC6811ChainBus::kDiagnoseMux,
+    LTC6811ChainBus::kDiagnoseMux};
+static constexpr ModeFrames kOpenWirePullUpFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartOpenWireConversion(mode, true, false, CellSelection::kAll);
+});
+static constexpr ModeFrames kOpenWirePullDownFrames = framesForModes([](AdcMode mode) {
+  return LTC6811ChainBus::StartOpenWireConversion(mode, false, false, CellSelection::kAll);
+});
+
+static_assert(BMS_BANK_COUNT <= LTC6811ChainBus::kMaxChips,
+              "Chip masks only have room for 32 banks");
+
+// Cell voltage measured while balancing, with the drops of the balancing
+// currents on its sense wires taken back out
+//
+// A discharging cell reads low by its current across both of its wires
+// (kBalanceDropResistance). The connected cells above and below it share one
+// of those wires, and read high by the drop on that wire, taken as half of the
+// pair. Every current is the measured voltage over the balance resistor.
+//
+// discharging: discharge state of the bank the cell is in, C1 in the LSB
+//
+// Units: millivolts
+static uint16_t removeBalanceDrops(uint16_t voltage, unsigned int bank, unsigned int pin,
+                                   uint32_t discharging) {
+  uint32_t pins = kPackTopology.cellPins(bank);
+  // Connected neighbours, 32 if there is none
+  unsigned int below = 32;
+  for (unsigned int i = pin; i > 0; i--) {
+    if (pins & (1u << (i - 1))) {
+      below = i - 1;
+      break;
     }
-    if (m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupD(), i),
-            (uint8_t *)rawVoltages + 18) != LTC681xBus::LTC681xBusStatus::Ok) {
-      printf("Things are not okay. SelfTestVoltageD\n");
+  }
+  unsigned int above = 32;
+  for (unsigned int i = pin + 1; i < 32; i++) {
+    if (pins & (1u << i)) {
+      above = i;
+      break;
     }
+  }
 
-    for (int j = 0; j < 12; j++) {
-      printf("AXST %2d: %4x\n", j, rawVoltages[i]);
-    }
+  // In milliohms, divided by the balance resistor at the end
+  int32_t drop = 0;
+  if (discharging & (1u << pin)) {
+    drop += kBalanceDropResistance[kPackTopology.cellIndex(bank, pin)];
+  }
+  if (below < 32 && (discharging & (1u << below))) {
+    drop -= kBalanceDropResistance[kPackTopology.cellIndex(bank, below)] / 2;
+  }
+  if (above < 32 && (discharging & (1u << above))) {
+    drop -= kBalanceDropResistance[kPackTopology.cellIndex(bank, above)] / 2;
+  }
+  return voltage + (int32_t)voltage * drop / (BMS_BALANCE_RESISTOR * 1000);
+}
+
+// Add the sum of cells from status group A of one chip to packVoltage
+//
+// returns: false if the PEC does not match
+static bool addSumOfCells(const uint8_t *rawStatus, uint32_t &packVoltage) {
+  if (!checkPec15(rawStatus, 6)) {
+    return false;
+  }
+  // SC = sum of cells / 30 in 100uV steps, so 3mV per count
+  uint16_t sum = ((uint16_t)rawStatus[0]) | ((uint16_t)rawStatus[1] << 8);
+  packVoltage += (uint32_t)sum * 3;
+  return true;
+}
+
+// Add the OV/UV flags of count cells, four cells to a byte starting from the
+// LSB with UV below OV, to per-pin masks starting at pin first
+static void addVoltageFlags(const uint8_t *flags, unsigned int first, unsigned int count,
+                            uint32_t &undervoltage, uint32_t &overvoltage) {
+  for (unsigned int i = 0; i < count; i++) {
+    uint8_t bits = flags[i / 4] >> ((i % 4) * 2);
+    undervoltage |= (uint32_t)(bits & 0b01) << (first + i);
+    overvoltage |= (uint32_t)((bits & 0b10) >> 1) << (first + i);
   }
-  printf("BMS B\n");
+}
 
-  // Cell GPIO self test
-  m_bus.WakeupBus();
-  m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
-      StartSelfTestGpio(AdcMode::k7k, SelfTestMode::kSelfTest1)));
-  ThisThread::sleep_for(4ms);
-  m_bus.WakeupBus();
+template <typename Chip>
+BMSThread<Chip>::BMSThread(LTC681xBus &bus, unsigned int frequency, BmsEventMailbox* bmsEventMailbox, MainToBMSMailbox* mainToBMSMailbox, PackVoltageMailbox* packVoltageMailbox, std::vector<LTC6811ChainBus*> chains, LTC6811ChainBus* addressedReader)
+    : m_bus(bus), m_chains(chains), m_addressedReader(addressedReader), m_configs(bus, m_chips, m_chains), m_openWire(*this), m_selfTest(*this), bmsEventMailbox(bmsEventMailbox), mainToBMSMailbox(mainToBMSMailbox), packVoltageMailbox(packVoltageMailbox) {
+  // Reads keep per chain state in arrays of this size
+  MBED_ASSERT(m_chains.size() <= BMS_ISOSPI_CHAIN_COUNT);
   for (int i = 0; i < BMS_BANK_COUNT; i++) {
-    uint16_t rawVoltages[12];
-    if (m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupA(), i),
-            (uint8_t *)rawVoltages) != LTC681xBus::LTC681xBusStatus::Ok) {
-      printf("Things are not okay. SelfTestVoltageA\n");
-    }
-    if (m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupB(), i),
-            (uint8_t *)rawVoltages + 6) != LTC681xBus::LTC681xBusStatus::Ok) {
-      printf("Things are not okay. SelfTestVoltageB\n");
-    }
+    m_chips.push_back(Chip(bus, i));
 
-    for (int j = 0; j < 12; j++) {
-      printf("CVST %2d: %4x\n", j, rawVoltages[i]);
-    }
+    // The comparators flag the same limits the scan checks in software
+    LTC6811::Configuration &config = m_chips[i].getConfig();
+    config.undervoltageComparison = LTC6811::undervoltageThreshold(BMS_FAULT_VOLTAGE_THRESHOLD_LOW);
+    config.overvoltageComparison = LTC6811::overvoltageThreshold(BMS_FAULT_VOLTAGE_THRESHOLD_HIGH);
+
+    // Hardware safety net for balancing, the shortest timeout the chip has
+    config.dischargeTimeout = LTC6811::DischargeTimeoutValue::k0_5;
+  }
+
+  // The self tests run at least once, at startup
+  if (BMS_OPEN_WIRE_PERIOD > 0) {
+    m_diagnostics.add(&m_openWire);
   }
+  m_diagnostics.add(&m_selfTest);
+}
+
+template <typename Chip>
+void BMSThread<Chip>::threadWorker() {
+  printf("BMS threadWorker()\n");
+
+  // Bring up the bus, every chip gets the same configuration so this is a
+  // single broadcast write
+  wakeupBus();
+  m_configs.flush();
+  m_bootTimings.busReady = sinceBoot();
 
-  printf("SELF TEST DONE \n");
+  // Straight to the first scan, the self tests follow between scans
   bmsState = BMSThreadState::BMSIdle;
 
-  std::array<uint16_t, BMS_BANK_COUNT * BMS_BANK_CELL_COUNT> allVoltages;
-  std::array<int8_t, BMS_BANK_COUNT * BMS_BANK_TEMP_COUNT> allTemps;
+  const auto &allVoltages = m_snapshot.cellVoltages;
   while (true) {
 
       bool isBalancing = false;
+      m_retryBudget = BMS_READ_RETRY_BUDGET;
 
     while(!mainToBMSMailbox->empty()) {
         MainToBMSEvent *mainToBMSEvent;
@@ -106,185 +183,174 @@ void BMSThread::threadWorker() {
             continue;
         }
 
-        balanceAllowed = mainToBMSEvent->balanceAllowed;
-        charging = mainToBMSEvent->charging;
+        applyMainEvent(mainToBMSEvent);
         // printf("Balance Allowed: %x\nCharging: %x\n", balanceAllowed, charging);
-        delete mainToBMSEvent;
     }
 
 
 
-    m_bus.WakeupBus();
+    wakeupBus();
 
-    // Set all status lights high
-    // TODO: This should be in some sort of config class
+    AdcMode cellMode = applyAdcSettings(AdcPurpose::kCellVoltage);
 
+    // Set all status lights high
+    bool wasDischarging = false;
     for (int i = 0; i < BMS_BANK_COUNT; i++) {
       LTC6811::Configuration &config = m_chips[i].getConfig();
       config.gpio5 = LTC6811::GPIOOutputState::kLow;
-      m_chips[i].updateConfig();
-    }
+      // Keep the reference up through the fast paths, parked it would only
+      // burn current between conversions that are seconds apart
+      config.referencePowerOff = parked ? LTC6811::ReferencePowerOff::kAfterConversions
+                                        : LTC6811::ReferencePowerOff::kWatchdogTimeout;
 
-    // turn off cell balancing for voltage reading
-    for (int i = 0; i < BMS_BANK_COUNT; i++) {
-        LTC6811::Configuration &config = m_chips[i].getConfig();
-
-        config.dischargeState.value = 0x0000;
-
-        m_chips[i].updateConfig();
+#if !BMS_BALANCE_DURING_MEASUREMENT
+      // turn off cell balancing for voltage reading
+      wasDischarging = wasDischarging || config.dischargeState.value != 0;
+      config.dischargeState.value = 0x0000;
+#endif
+    }
+    // Let the cells recover from the balancing current, nothing to wait for
+    // when there was none (e.g. at startup)
+    if (m_configs.flush() > 0 && wasDischarging) {
+      ThisThread::sleep_for(5ms);
     }
-    ThisThread::sleep_for(5ms);
 
     // Start ADC on all chips
-    auto startAdcCmd =
-        StartCellVoltageADC(AdcMode::k7k, false, CellSelection::kAll);
-    if (m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(startAdcCmd)) !=
-        LTC681xBus::LTC681xBusStatus::Ok) {
+#if BMS_COMBINED_CONVERSION
+    // Sum of cells comes out of the same conversion run
+    if (!startConversion(Conversion::kCellVoltageSum, cellMode)) {
       printf("Things are not okay. StartADC\n");
     }
+    auto cellConversion = AdcConversion::kCellVoltageSum;
+#else
+    if (!startConversion(Conversion::kCellVoltage, cellMode)) {
+      printf("Things are not okay. StartADC\n");
+    }
+    auto cellConversion = AdcConversion::kCellVoltage;
+#endif
 
-    ThisThread::sleep_for(10ms);
-
-    // Read back values from all chips
-    for (int i = 0; i < BMS_BANK_COUNT; i++) {
-      if (m_bus.PollAdcCompletion(
-              LTC681xBus::BuildAddressedBusCommand(PollADCStatus(), 0)) ==
-          LTC681xBus::LTC681xBusStatus::PollTimeout) {
-        printf("Poll timeout.\n");
-      } else {
-        //printf("Poll OK.\n");
-      }
-
-      uint16_t rawVoltages[12];
+    if (!waitForConversion(cellConversion, cellMode)) {
+      printf("Poll timeout.\n");
+    }
 
-      if (m_bus.SendReadCommand(
-              LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupA(), i),
-              (uint8_t *)rawVoltages) != LTC681xBus::LTC681xBusStatus::Ok) {
-        printf("Things are not okay. VoltageA\n");
+    // Read back voltages from all chips, one register group at a time, each
+    // chip's cells decoded straight out of the receive buffer into the
+    // snapshot. Chips that can't be read keep their cell voltages from the
+    // last scan, and are marked stale
+    uint32_t unreadCells = 0;
+    for (uint8_t group = 0; group < kCellGroupCount; group++) {
+      auto decode = [this, group](unsigned int bank, const uint8_t *rawGroup) {
+        return decodeVoltageGroup(group, bank, rawGroup);
+      };
+      uint32_t failed;
+      if (!readRegisterGroup(kCellVoltageGroups[group], decode, &failed)) {
+        printf("Things are not okay. Voltage%c\n", 'A' + group);
       }
-      if (m_bus.SendReadCommand(
-              LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupB(), i),
-              (uint8_t *)rawVoltages + 6) != LTC681xBus::LTC681xBusStatus::Ok) {
-        printf("Things are not okay. VoltageB\n");
-      }
-      if (m_bus.SendReadCommand(
-              LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupC(), i),
-              (uint8_t *)rawVoltages + 12) !=
-          LTC681xBus::LTC681xBusStatus::Ok) {
-        printf("Things are not okay. VoltageC\n");
-      }
-      if (m_bus.SendReadCommand(
-              LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupD(), i),
-              (uint8_t *)rawVoltages + 18) !=
-          LTC681xBus::LTC681xBusStatus::Ok) {
-        printf("Things are not okay. VoltageD\n");
-      }
-
-      // MUX get temp from each cell
-      for (uint8_t j = 0; j < BMS_BANK_CELL_COUNT; j++) {
-
-        LTC6811::Configuration &config = m_chips[i].getConfig();
-        config.gpio1 = (j & 0b001) ? LTC6811::GPIOOutputState::kHigh
-                                   : LTC6811::GPIOOutputState::kLow;
-        config.gpio2 = ((j & 0b010) >> 1) ? LTC6811::GPIOOutputState::kHigh
-                                          : LTC6811::GPIOOutputState::kLow;
-        config.gpio3 = ((j & 0b100) >> 2) ? LTC6811::GPIOOutputState::kHigh
-                                          : LTC6811::GPIOOutputState::kLow;
-        config.gpio4 = LTC6811::GPIOOutputState::kPassive;
-
-        m_chips[i].updateConfig();
+      unreadCells |= failed;
+    }
+    m_snapshot.staleVoltageBanks = unreadCells;
+    bool allCellsRead = unreadCells == 0;
 
-        auto gpioADCcmd = StartGpioADC(AdcMode::k7k, GpioSelection::k4);
-        if (m_bus.SendCommand(LTC681xBus::BuildAddressedBusCommand(
-                gpioADCcmd, i)) != LTC681xBus::LTC681xBusStatus::Ok) {
-          printf("Things are not okay. StartGPIO ADC\n");
+    // Extremes and sum of the cells, one pass over the snapshot now that every
+    // group has been read. Stale banks are left out, checkStaleBanks() deals
+    // with those.
+    Reduction<uint16_t> voltages = reduceCellVoltages(m_snapshot, m_snapshot.staleVoltageBanks);
+    // The pack voltage checks compare against every cell, so stale banks count
+    // there with their older values
+    m_lastCellSum = voltages.sum;
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      if (m_snapshot.staleVoltageBanks & (1u << i)) {
+        for (uint16_t voltage : m_snapshot.bankVoltages(i)) {
+          m_lastCellSum += voltage;
         }
-
-        ThisThread::sleep_for(5ms);
-
-        uint8_t rxbuf[8 * 2];
-
-        m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupA(), i),
-            rxbuf);
-        m_bus.SendReadCommand(
-            LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupB(), i),
-            rxbuf + 8);
-
-        uint16_t tempVoltage = ((uint16_t)rxbuf[8]) | ((uint16_t)rxbuf[9] << 8);
-
-        int8_t temp = convertTemp(tempVoltage / 10);
-        // printf("%d: T: %d\n", j, temp);
-        allTemps[(BMS_BANK_CELL_COUNT * i) + j] = temp;
       }
+    }
 
-      for (int j = 0; j < 12; j++) {
-        // Endianness of the protocol allows a simple cast :-)
-        uint16_t voltage = rawVoltages[j] / 10;
-
-        int index = BMS_CELL_MAP[j];
-        if (index != -1) {
-          allVoltages[(BMS_BANK_CELL_COUNT * i) + index] = voltage;
-
-        // printf("%d: V: %d\n", index, voltage);
+    uint32_t packVoltage = 0;
+#if BMS_COMBINED_CONVERSION
+    // SC is the first value of status group A
+    uint32_t failedStatus;
+    auto decodeStatus = [&packVoltage](unsigned int bank, const uint8_t *rawStatus) {
+      return addSumOfCells(rawStatus, packVoltage);
+    };
+    if (!readRegisterGroup(RegisterGroup::kStatusA, decodeStatus, &failedStatus)) {
+      printf("Things are not okay. StatusA\n");
+    }
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      if (failedStatus & (1u << i)) {
+        // Fall back to adding up the cells of this bank
+        for (uint16_t voltage : m_snapshot.bankVoltages(i)) {
+          packVoltage += voltage;
         }
       }
     }
-    // printf("Fuck: ");
-    uint16_t minVoltage = allVoltages[0];
-    uint16_t maxVoltage = 0;
-    for (int i = 0; i < BMS_BANK_COUNT * BMS_BANK_CELL_COUNT; i++) {
-        // if (allVoltages[i] > BMS_FAULT_VOLTAGE_THRESHOLD_HIGH) {
-        //     printf("%d, ", i);
-        // }
-      if (allVoltages[i] < minVoltage) {
-        minVoltage = allVoltages[i];
-      } else if (allVoltages[i] > maxVoltage) {
-        maxVoltage = allVoltages[i];
-      }
+#else
+    packVoltage = m_lastCellSum;
+#endif
+
+    m_snapshot.staleTemperatureBanks = 0;
+    if (!m_chains.empty() || BMS_TEMP_SCAN_BROADCAST) {
+      scanTemperaturesBroadcast();
+    } else {
+      scanTemperaturesPerChip();
+    }
+    checkStaleBanks();
+
+    // Until every chip has been read, part of the snapshot is still empty
+    if (m_bootTimings.firstScan.count() == 0 && allCellsRead) {
+      m_bootTimings.firstScan = sinceBoot();
     }
-    // printf ("\n");
 
-    int8_t minTemp = allTemps[0];
-    int8_t maxTemp = 0;
-    int8_t avgTemp = 0;
-    int16_t tempSum = 0;
-    for (int i = 0; i < BMS_BANK_COUNT * BMS_BANK_TEMP_COUNT; i++) {
-      tempSum += allTemps[i];
-      if (allTemps[i] < minTemp) {
-        minTemp = allTemps[i];
-      } else if (allTemps[i] > maxTemp) {
-        maxTemp = allTemps[i];
+    Reduction<int8_t> temps = reduceTemperatures(m_snapshot, m_snapshot.staleTemperatureBanks);
+    // Thermistors off their curve (open or shorted) are left out of the
+    // temperatures and fault on their own
+    unsigned int readThermistors = 0;
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      if (!(m_snapshot.staleTemperatureBanks & (1u << i))) {
+        readThermistors += kPackTopology.thermistorCount(i);
       }
     }
-    avgTemp = tempSum / (BMS_BANK_COUNT * BMS_BANK_TEMP_COUNT);
+    unsigned int thermistorFaults = readThermistors - temps.count;
+    uint16_t minVoltage = voltages.min;
+    uint16_t maxVoltage = voltages.max;
+    int8_t minTemp = temps.min;
+    int8_t maxTemp = temps.max;
+    int8_t avgTemp = temps.average();
     // printf("0 Temps: %d, %d, %d, %d, %d, %d, %d\n", allTemps[0], allTemps[1], allTemps[2], allTemps[3], allTemps[4], allTemps[5], allTemps[6]);
     // printf("1 Temps: %d, %d, %d, %d, %d, %d, %d\n", allTemps[7], allTemps[8], allTemps[9], allTemps[10], allTemps[11], allTemps[12], allTemps[13]);
     // printf("2 Temps: %d, %d, %d, %d, %d, %d, %d\n", allTemps[14], allTemps[15], allTemps[16], allTemps[17], allTemps[18], allTemps[19], allTemps[20]);
     // printf("3 Temps: %d, %d, %d, %d, %d, %d, %d\n\n", allTemps[21], allTemps[22], allTemps[23], allTemps[24], allTemps[25], allTemps[26], allTemps[27]);
     // printf("min temp: %d, max temp: %d\nmin volt: %d, max volt %d\n", minTemp, maxTemp, minVoltage, maxVoltage);
 
-    if (minVoltage <= BMS_FAULT_VOLTAGE_THRESHOLD_LOW ||
-        maxVoltage >= BMS_FAULT_VOLTAGE_THRESHOLD_HIGH ||
-        minTemp <= BMS_FAULT_TEMP_THRESHOLD_LOW ||
-        maxTemp >= ((charging) ? BMS_FAULT_TEMP_THRESHOLD_CHARING_HIGH : BMS_FAULT_TEMP_THRESHOLD_HIGH)) {
+    // With nothing read there is nothing to check, the stale banks fault on
+    // their own
+    bool voltageFault = voltages.count > 0 &&
+                        (minVoltage <= BMS_FAULT_VOLTAGE_THRESHOLD_LOW ||
+                         maxVoltage >= BMS_FAULT_VOLTAGE_THRESHOLD_HIGH);
+    bool tempFault = temps.count > 0 &&
+                     (minTemp <= BMS_FAULT_TEMP_THRESHOLD_LOW ||
+                      maxTemp >= ((charging) ? BMS_FAULT_TEMP_THRESHOLD_CHARING_HIGH : BMS_FAULT_TEMP_THRESHOLD_HIGH));
+    if (voltageFault || tempFault || thermistorFaults > 0) {
 
         if (minVoltage <= BMS_FAULT_VOLTAGE_THRESHOLD_LOW) {
-            printf("Voltage too low: %d\n", minVoltage);
+            printf("Voltage too low: %d (cell %d)\n", minVoltage, voltages.argMin);
         }
         if (maxVoltage >= BMS_FAULT_VOLTAGE_THRESHOLD_HIGH) {
-            printf("Voltage too high: %d\n", maxVoltage);
+            printf("Voltage too high: %d (cell %d)\n", maxVoltage, voltages.argMax);
             printf("Voltages: ");
-            for (int l = 0; l < BMS_BANK_COUNT * BMS_BANK_CELL_COUNT; l++) {
+            for (int l = 0; l < BMS_CELL_COUNT; l++) {
                 printf("%d, ", allVoltages[l]);
             }
             printf("\n");
         }
         if (minTemp <= BMS_FAULT_TEMP_THRESHOLD_LOW) {
-            printf("Temp too low: %d\n", minTemp);
+            printf("Temp too low: %d (thermistor %d)\n", minTemp, temps.argMin);
         }
         if (maxTemp >= ((charging) ? BMS_FAULT_TEMP_THRESHOLD_CHARING_HIGH : BMS_FAULT_TEMP_THRESHOLD_HIGH)) {
-            printf("Temp too high: %d\n", maxTemp);
+            printf("Temp too high: %d (thermistor %d)\n", maxTemp, temps.argMax);
+        }
+        if (thermistorFaults > 0) {
+            printf("Thermistors off their curve: %u\n", thermistorFaults);
         }
 
 
@@ -293,85 +359,1530 @@ void BMSThread::threadWorker() {
             printf("FAULT STATE\n");
             throwBmsFault();
         } else {
-            printf("ENTERING FAULT RECOVERY\n");
-            bmsState = BMSThreadState::BMSFaultRecover;
-            ThisThread::sleep_for(10ms);
+            // Minimum and maximum above are stale if it clears, start over
+            recoverFault(findSuspects());
             continue;
         }
     }
 
-    if (bmsState == BMSThreadState::BMSIdle && balanceAllowed) {
-      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    // The planner limits balancing by the die temperatures, only needed
+    // while balancing
+    bool balance = bmsState == BMSThreadState::BMSIdle && balanceAllowed;
+    if (balance) {
+      measureDieTemperatures();
+    }
+    uint32_t dischargeValues[BMS_BANK_COUNT];
+    m_balancePlanner.update(m_snapshot, balance, Kernel::Clock::now(), dischargeValues);
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      // printf("discharge value: %x\n", dischargeValues[i]);
+      m_chips[i].getConfig().dischargeState.value = dischargeValues[i];
+      isBalancing = isBalancing || dischargeValues[i] != 0;
+    }
 
-        LTC6811::Configuration &config = m_chips[i].getConfig();
+    uint32_t dischargingChips = 0;
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      LTC6811::Configuration &config = m_chips[i].getConfig();
+      config.gpio5 = LTC6811::GPIOOutputState::kLow;
+      dischargingChips |= (uint32_t)(config.dischargeState.value != 0) << i;
+    }
+    // Every write restarts the discharge timer of the chip, so a chip that
+    // is balancing gets its configuration again every scan even if nothing
+    // changed. If the scans stop, the timer ends balancing.
+    m_configs.invalidate(dischargingChips);
+    m_configs.flush();
 
-        uint16_t dischargeValue = 0x0000;
+    // Check that the chips still hold what was written, anything that reset
+    // gets rewritten on the next flush
+    uint8_t configReadback[BMS_BANK_COUNT * 6];
+    if (!readRegisterGroup(RegisterGroup::kConfigurationA, configReadback)) {
+      printf("Things are not okay. ConfigurationA\n");
+    } else if (!m_configs.verify(configReadback)) {
+      printf("Configuration mismatch\n");
+    }
 
-        for (int j = 0; j < 12; j++) {
-          if (BMS_CELL_MAP[j] == -1) {
-            continue;
-          }
-          int cellNum = BMS_CELL_MAP[j];
-          uint16_t cellVoltage = allVoltages[i * BMS_BANK_CELL_COUNT + cellNum];
-          if (cellVoltage >= BMS_BALANCE_THRESHOLD &&
-              cellVoltage >= minVoltage + BMS_DISCHARGE_THRESHOLD) {
-            // printf("Balancing cell %d\?n", cellNum);
-            dischargeValue |= (0x1 << j);
-            isBalancing = true;
+    // The thread keeps its own snapshot, stale banks and the diagnostics
+    // carry over from it into the next scan. Published, it is copied straight
+    // into the slot.
+    if (BmsEvent* msg = bmsEventMailbox->try_alloc()) {
+        msg->snapshot = m_snapshot;
+        msg->bmsState = bmsState;
+        msg->isBalancing = isBalancing;
+        msg->minVolt = (uint8_t)(minVoltage*50/1000.0);
+        msg->maxVolt = (uint8_t)(maxVoltage*50/1000.0);
+        msg->minTemp = minTemp;
+        msg->maxTemp = maxTemp;
+        msg->avgTemp = avgTemp;
+        msg->minVoltCell = voltages.argMin;
+        msg->maxVoltCell = voltages.argMax;
+        msg->minTempThermistor = temps.argMin;
+        msg->maxTempThermistor = temps.argMax;
+        msg->thermistorFaults = thermistorFaults;
+        msg->packVoltage = packVoltage;
+        msg->validated = m_bootTimings.selfTests.count() != 0;
+        for (int i = 0; i < BMS_BANK_COUNT; i++) {
+            msg->linkHealth[i] = m_linkHealth[i];
+            msg->diagnostics[i] = m_chipDiagnostics[i];
+            msg->validated &= m_chipDiagnostics[i].failed == 0;
+        }
+        if (m_bootTimings.firstScan.count() != 0 && m_bootTimings.firstSnapshot.count() == 0) {
+            m_bootTimings.firstSnapshot = sinceBoot();
+        }
+        msg->boot = m_bootTimings;
+        bmsEventMailbox->put(msg);
+    }
+
+
+    // longer duty cycle when charging, 500 default
+    constexpr std::chrono::milliseconds parkedPeriod(BMS_PARKED_SCAN_PERIOD);
+    auto nextScan = Kernel::Clock::now() + (parked ? parkedPeriod : charging ? 500ms : 100ms);
+
+    Suspects flagged;
+    if (waitForNextScan(nextScan, flagged)) {
+      // Full scan straight away either way, to catch up on the rest
+      recoverFault(flagged);
+      continue;
+    }
+    if (bmsState == BMSThreadState::BMSFaultRecover) {
+        bmsState = BMSThreadState::BMSIdle;
+    }
+  }
+}
+
+template <typename Chip>
+void BMSThread<Chip>::throwBmsFault() {
+    //bmsState = BMSThreadState::BMSFault;
+}
+
+template <typename Chip>
+AdcMode BMSThread<Chip>::applyAdcSettings(AdcPurpose purpose) {
+  // ADCOPT lives in the configuration, it goes out with the next flush
+  AdcSettings settings = selectAdcSettings(purpose, charging);
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    m_chips[i].getConfig().adcMode = settings.option;
+  }
+  return settings.mode;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::wakeupBus() {
+  if (m_chains.empty()) {
+    m_bus.WakeupBus();
+  }
+  for (LTC6811ChainBus *chain : m_chains) {
+    chain->WakeupBus();
+  }
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::startConversion(Conversion conversion, AdcMode mode) {
+  if (!m_chains.empty()) {
+    const ModeFrames *frames = &kCellVoltageFrames;
+    switch (conversion) {
+      case Conversion::kSelfTestCellVoltage: frames = &kSelfTestCellVoltageFrames; break;
+      case Conversion::kSelfTestGpio: frames = &kSelfTestGpioFrames; break;
+      case Conversion::kCellVoltage: frames = &kCellVoltageFrames; break;
+      case Conversion::kCellVoltageSum: frames = &kCellVoltageSumFrames; break;
+      case Conversion::kThermistor: frames = &kThermistorFrames; break;
+      case Conversion::kSumOfCells: frames = &kSumOfCellsFrames; break;
+      case Conversion::kOverlap: frames = &kOverlapFrames; break;
+      case Conversion::kDiagnoseMux: frames = &kDiagnoseMuxFrames; break;
+      case Conversion::kDieTemperature: frames = &kDieTemperatureFrames; break;
+    }
+    const CommandFrame &cmd = (*frames)[(uint8_t)mode & 0b11];
+
+    // Start every chain before waiting on any of them, so all banks convert
+    // at the same time
+    bool ok = true;
+    for (LTC6811ChainBus *chain : m_chains) {
+      ok = chain->SendCommand(cmd) == LTC6811ChainBus::Status::Ok && ok;
+    }
+    return ok;
+  }
+
+  LTC681xBus::LTC681xBusStatus status = LTC681xBus::LTC681xBusStatus::Ok;
+  switch (conversion) {
+    case Conversion::kSelfTestCellVoltage:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartSelfTestCellVoltage(mode, SelfTestMode::kSelfTest1)));
+      break;
+    case Conversion::kSelfTestGpio:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartSelfTestGpio(mode, SelfTestMode::kSelfTest1)));
+      break;
+    case Conversion::kCellVoltage:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartCellVoltageADC(mode, kDischargePermitted, CellSelection::kAll)));
+      break;
+    case Conversion::kCellVoltageSum:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartCombinedCellVoltageSumADC(mode, kDischargePermitted)));
+      break;
+    case Conversion::kThermistor:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartGpioADC(mode, GpioSelection::k4)));
+      break;
+    case Conversion::kSumOfCells:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartStatusADC(mode, StatusGroupSelection::kSC)));
+      break;
+    case Conversion::kOverlap:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartOverlapMeasurement(mode, false)));
+      break;
+    case Conversion::kDiagnoseMux:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(DiagnoseMux()));
+      break;
+    case Conversion::kDieTemperature:
+      status = m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+          StartStatusADC(mode, StatusGroupSelection::kITMP)));
+      break;
+  }
+  return status == LTC681xBus::LTC681xBusStatus::Ok;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::startCellPairConversion(uint8_t pair, AdcMode mode) {
+  // Rarely used, so the chain frame and its PEC are built on the spot
+  CellSelection cells = (CellSelection)(pair + 1);
+  if (!m_chains.empty()) {
+    CommandFrame cmd = makeCommandFrame(
+        LTC6811ChainBus::StartCellVoltageADC(mode, kDischargePermitted, cells));
+    bool ok = true;
+    for (LTC6811ChainBus *chain : m_chains) {
+      ok = chain->SendCommand(cmd) == LTC6811ChainBus::Status::Ok && ok;
+    }
+    return ok;
+  }
+
+  return m_bus.SendCommand(LTC681xBus::BuildBroadcastBusCommand(
+             StartCellVoltageADC(mode, kDischargePermitted, cells))) ==
+         LTC681xBus::LTC681xBusStatus::Ok;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::readRegisterGroup(RegisterGroup group, uint8_t *data) {
+  return startReadRegisterGroup(group) && finishReadRegisterGroup(data);
+}
+
+template <typename Chip>
+template <typename F>
+bool BMSThread<Chip>::readRegisterGroup(RegisterGroup group, F decode, uint32_t *failedChips,
+                                        uint32_t chips) {
+  // A chain that failed to start still has to be finished with the others
+  bool started = startReadRegisterGroup(group);
+  return finishReadRegisterGroup(decode, failedChips, chips) && started;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::startReadRegisterGroup(RegisterGroup group) {
+  m_pendingRead = group;
+  if (!m_chains.empty()) {
+    // Chains sit on separate SPI peripherals, so their transfers all run at
+    // the same time
+    bool ok = true;
+    for (LTC6811ChainBus *chain : m_chains) {
+      ok = chain->StartReadCommand(chainReadFrame(group)) == LTC6811ChainBus::Status::Ok && ok;
+    }
+    return ok;
+  }
+
+  // The parallel bus reads one chip at a time, those reads happen in
+  // finishReadRegisterGroup()
+  return true;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::finishReadRegisterGroup(uint8_t *data, uint32_t *failedChips) {
+  return finishReadRegisterGroup(
+      [data](unsigned int bank, const uint8_t *group) {
+        if (!checkPec15(group, 6)) {
+          return false;
+        }
+        memcpy(data + bank * 6, group, 6);
+        return true;
+      },
+      failedChips);
+}
+
+template <typename Chip>
+template <typename F>
+bool BMSThread<Chip>::finishReadRegisterGroup(F decode, uint32_t *failedChips, uint32_t chips) {
+  uint32_t failed = 0;
+
+  if (!m_chains.empty()) {
+    // Chips still to be filled per chain, the transfers started by
+    // startReadRegisterGroup() are all in flight
+    uint32_t chainChips[BMS_ISOSPI_CHAIN_COUNT];
+    unsigned int first = 0;
+    for (size_t c = 0; c < m_chains.size(); c++) {
+      chainChips[c] = chips >> first;
+      first += m_chains[c]->getChipCount();
+    }
+
+    for (int attempt = 0;; attempt++) {
+      // Each chain fills the slots of its own banks
+      bool anyFailed = false;
+      first = 0;
+      for (size_t c = 0; c < m_chains.size(); c++) {
+        LTC6811ChainBus *chain = m_chains[c];
+        if (chainChips[c] != 0) {
+          auto chainDecode = [&decode, first](unsigned int chip, const uint8_t *group) {
+            return decode(first + chip, group);
+          };
+          LTC6811ChainBus::Status status = chain->FinishReadCommand(chainDecode, chainChips[c]);
+          chainChips[c] = chain->getFailedChips();
+          // A peripheral that was busy counts like a chain that didn't answer
+          recordLinkErrors(first, chainChips[c], status == LTC6811ChainBus::Status::Timeout ||
+                                                     status == LTC6811ChainBus::Status::Busy);
+          anyFailed = anyFailed || chainChips[c] != 0;
+        }
+        first += chain->getChipCount();
+      }
+      if (!anyFailed || attempt >= BMS_READ_RETRY_LIMIT || m_retryBudget == 0) {
+        break;
+      }
+
+      // Every chip on a chain answers a retry, but only the slots that failed
+      // get filled from it. The retries of all chains are started before any
+      // is waited on, like the first read.
+      m_retryBudget--;
+      first = 0;
+      for (size_t c = 0; c < m_chains.size(); c++) {
+        if (chainChips[c] != 0) {
+          recordRetries(first, chainChips[c]);
+          m_chains[c]->StartReadCommand(chainReadFrame(m_pendingRead));
+        }
+        first += m_chains[c]->getChipCount();
+      }
+    }
+
+    first = 0;
+    for (size_t c = 0; c < m_chains.size(); c++) {
+      failed |= chainChips[c] << first;
+      first += m_chains[c]->getChipCount();
+    }
+  } else {
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      if (!(chips & (1u << i))) {
+        continue;
+      }
+      // SendReadCommand() hands back the 6 data bytes followed by their PEC,
+      // which decode checks
+      uint8_t rxbuf[8];
+      auto chipDecode = [&decode, i](unsigned int chip, const uint8_t *group) {
+        return decode(i, group);
+      };
+      for (int attempt = 0;; attempt++) {
+        bool timeout;
+        bool decoded;
+        if (m_addressedReader) {
+          // The thread sleeps while the transfer runs. A busy peripheral
+          // counts like a chip that didn't answer, nothing was sent to wait on.
+          LTC6811ChainBus::Status status = m_addressedReader->StartReadCommand(
+              makeAddressedCommandFrame(chainReadFrame(m_pendingRead), i));
+          if (status == LTC6811ChainBus::Status::Ok) {
+            status = m_addressedReader->FinishReadCommand(chipDecode);
           }
+          timeout = status == LTC6811ChainBus::Status::Timeout ||
+                    status == LTC6811ChainBus::Status::Busy;
+          decoded = status == LTC6811ChainBus::Status::Ok;
+        } else {
+          timeout = readAddressedGroup(m_pendingRead, i, rxbuf) != LTC681xBus::LTC681xBusStatus::Ok;
+          decoded = !timeout && decode(i, rxbuf);
+        }
+        if (decoded) {
+          break;
+        }
+        recordLinkErrors(i, 1, timeout);
+
+        // Keep the last good value of a chip that can't be read, like the
+        // daisy chain does
+        if (attempt >= BMS_READ_RETRY_LIMIT || m_retryBudget == 0) {
+          failed |= 1u << i;
+          break;
         }
+        m_retryBudget--;
+        recordRetries(i, 1);
+      }
+    }
+  }
+
+  if (failedChips) {
+    *failedChips = failed;
+  }
+  return failed == 0;
+}
+
+template <typename Chip>
+const CommandFrame &BMSThread<Chip>::chainReadFrame(RegisterGroup group) {
+  switch (group) {
+    case RegisterGroup::kConfigurationA: return LTC6811ChainBus::kReadConfigurationGroupA;
+    case RegisterGroup::kCellVoltageA: return LTC6811ChainBus::kReadCellVoltageGroupA;
+    case RegisterGroup::kCellVoltageB: return LTC6811ChainBus::kReadCellVoltageGroupB;
+    case RegisterGroup::kCellVoltageC: return LTC6811ChainBus::kReadCellVoltageGroupC;
+    case RegisterGroup::kCellVoltageD: return LTC6811ChainBus::kReadCellVoltageGroupD;
+    case RegisterGroup::kCellVoltageE: return LTC6811ChainBus::kReadCellVoltageGroupE;
+    case RegisterGroup::kCellVoltageF: return LTC6811ChainBus::kReadCellVoltageGroupF;
+    case RegisterGroup::kAuxiliaryA: return LTC6811ChainBus::kReadAuxiliaryGroupA;
+    case RegisterGroup::kAuxiliaryB: return LTC6811ChainBus::kReadAuxiliaryGroupB;
+    case RegisterGroup::kAuxiliaryC: return LTC6811ChainBus::kReadAuxiliaryGroupC;
+    case RegisterGroup::kAuxiliaryD: return LTC6811ChainBus::kReadAuxiliaryGroupD;
+    case RegisterGroup::kStatusA: return LTC6811ChainBus::kReadStatusGroupA;
+    case RegisterGroup::kStatusB: return LTC6811ChainBus::kReadStatusGroupB;
+  }
+  return LTC6811ChainBus::kReadConfigurationGroupA;
+}
+
+template <typename Chip>
+LTC681xBus::LTC681xBusStatus BMSThread<Chip>::readAddressedGroup(RegisterGroup group, uint8_t chip,
+                                                                 uint8_t *rxbuf) {
+  switch (group) {
+    case RegisterGroup::kConfigurationA:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadConfigurationGroupA(), chip), rxbuf);
+    case RegisterGroup::kCellVoltageA:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupA(), chip), rxbuf);
+    case RegisterGroup::kCellVoltageB:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupB(), chip), rxbuf);
+    case RegisterGroup::kCellVoltageC:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupC(), chip), rxbuf);
+    case RegisterGroup::kCellVoltageD:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupD(), chip), rxbuf);
+    case RegisterGroup::kAuxiliaryA:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupA(), chip), rxbuf);
+    case RegisterGroup::kAuxiliaryB:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupB(), chip), rxbuf);
+    case RegisterGroup::kStatusA:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadStatusGroupA(), chip), rxbuf);
+    case RegisterGroup::kStatusB:
+      return m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadStatusGroupB(), chip), rxbuf);
+    case RegisterGroup::kCellVoltageE:
+    case RegisterGroup::kCellVoltageF:
+    case RegisterGroup::kAuxiliaryC:
+    case RegisterGroup::kAuxiliaryD:
+      // Only on the LTC6812 and LTC6813, which have no addressed variant
+      break;
+  }
+  return LTC681xBus::LTC681xBusStatus::PollTimeout;
+}
 
-        // printf("discharge value: %x\n", dischargeValue);
+template <typename Chip>
+void BMSThread<Chip>::recordLinkErrors(unsigned int first, uint32_t chips, bool timeout) {
+  for (unsigned int i = first; chips != 0; i++, chips >>= 1) {
+    if (chips & 1) {
+      if (timeout) {
+        m_linkHealth[i].timeouts++;
+      } else {
+        m_linkHealth[i].pecErrors++;
+      }
+    }
+  }
+}
 
-        config.dischargeState.value = dischargeValue;
+template <typename Chip>
+void BMSThread<Chip>::recordRetries(unsigned int first, uint32_t chips) {
+  for (unsigned int i = first; chips != 0; i++, chips >>= 1) {
+    if (chips & 1) {
+      m_linkHealth[i].retries++;
+    }
+  }
+}
 
-        m_chips[i].updateConfig();
+template <typename Chip>
+void BMSThread<Chip>::recordSelfTest(uint8_t test, const char *name, uint32_t tested,
+                                     uint32_t failed) {
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (!(tested & (1u << i))) {
+      continue;
+    }
+    ChipDiagnostics &diagnostics = m_chipDiagnostics[i];
+    diagnostics.tested |= test;
+    if (failed & (1u << i)) {
+      if (!(diagnostics.failed & test)) {
+        printf("Self test %s failed on bank %d\n", name, i);
       }
+      diagnostics.failed |= test;
+      diagnostics.failures++;
     } else {
-      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      if (diagnostics.failed & test) {
+        printf("Self test %s passed again on bank %d\n", name, i);
+      }
+      diagnostics.failed &= ~test;
+    }
+  }
+}
 
-        LTC6811::Configuration &config = m_chips[i].getConfig();
-        config.dischargeState.value = 0x0000;
-        m_chips[i].updateConfig();
+template <typename Chip>
+bool BMSThread<Chip>::pollConversion(uint32_t banks) {
+  if (!m_chains.empty()) {
+    bool done = true;
+    for (LTC6811ChainBus *chain : m_chains) {
+      done = chain->PollAdcCompletion() && done;
+    }
+    return done;
+  }
+
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if ((banks & (1u << i)) &&
+        m_bus.PollAdcCompletion(LTC681xBus::BuildAddressedBusCommand(PollADCStatus(), i)) !=
+            LTC681xBus::LTC681xBusStatus::Ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::waitForConversion(AdcConversion conversion, AdcMode mode) {
+  auto expected = conversionTime<typename Chip::Variant>(conversion, mode,
+                                                        m_chips[0].getConfig().adcMode);
+
+  if (!m_chains.empty()) {
+    size_t chain = 0;
+    bool done = ::waitForConversion(expected, [this, &chain] {
+      while (chain < m_chains.size()) {
+        if (!m_chains[chain]->PollAdcCompletion()) {
+          return false;
+        }
+        chain++;
+      }
+      return true;
+    });
+    if (!done) {
+      // PLADC can't tell which chip on the chain is still busy
+      unsigned int first = 0;
+      for (size_t i = 0; i < chain; i++) {
+        first += m_chains[i]->getChipCount();
+      }
+      uint32_t chips = m_chains[chain]->getChipCount() < LTC6811ChainBus::kMaxChips
+                           ? (1u << m_chains[chain]->getChipCount()) - 1
+                           : LTC6811ChainBus::kAllChips;
+      recordLinkErrors(first, chips, true);
+    }
+    return done;
+  }
+
+  // Chips that already finished answer the poll straight away, so this only
+  // waits on the slowest one
+  uint8_t chip = 0;
+  bool done = ::waitForConversion(expected, [this, &chip] {
+    while (chip < BMS_BANK_COUNT) {
+      if (m_bus.PollAdcCompletion(LTC681xBus::BuildAddressedBusCommand(PollADCStatus(), chip)) !=
+          LTC681xBus::LTC681xBusStatus::Ok) {
+        return false;
       }
+      chip++;
     }
+    return true;
+  });
+  if (!done) {
+    recordLinkErrors(chip, 1, true);
+  }
+  return done;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::setMuxChannel(LTC6811::Configuration &config, uint8_t channel) {
+  config.gpio1 = (channel & 0b001) ? LTC6811::GPIOOutputState::kHigh
+                                   : LTC6811::GPIOOutputState::kLow;
+  config.gpio2 = ((channel & 0b010) >> 1) ? LTC6811::GPIOOutputState::kHigh
+                                          : LTC6811::GPIOOutputState::kLow;
+  config.gpio3 = ((channel & 0b100) >> 2) ? LTC6811::GPIOOutputState::kHigh
+                                          : LTC6811::GPIOOutputState::kLow;
+  config.gpio4 = LTC6811::GPIOOutputState::kPassive;
+}
 
+template <typename Chip>
+void BMSThread<Chip>::scanTemperaturesBroadcast() {
+  // Step the mux of every bank together and convert GPIO4 on all chips at
+  // once, so the scan takes one conversion per channel regardless of bank count
+  AdcMode mode = applyAdcSettings(AdcPurpose::kTemperature);
+  constexpr uint8_t channels = kPackTopology.maxThermistors();
+  for (uint8_t j = 0; j < channels; j++) {
     for (int i = 0; i < BMS_BANK_COUNT; i++) {
-      LTC6811::Configuration &config = m_chips[i].getConfig();
-      config.gpio5 = LTC6811::GPIOOutputState::kLow;
-      m_chips[i].updateConfig();
+      setMuxChannel(m_chips[i].getConfig(), j);
+    }
+    m_configs.flush();
+
+    if (!startConversion(Conversion::kThermistor, mode)) {
+      printf("Things are not okay. StartGPIO ADC\n");
+    }
+
+    if (!waitForConversion(AdcConversion::kGpioSingle, mode)) {
+      printf("Poll timeout. GPIO\n");
+    }
+
+    // GPIO4 is the first value of auxiliary group B, group A isn't needed
+    auto decode = [this, j](unsigned int bank, const uint8_t *rawAux) {
+      return decodeTemperature(j, bank, rawAux);
+    };
+    uint32_t failed;
+    if (!readRegisterGroup(RegisterGroup::kAuxiliaryB, decode, &failed)) {
+      printf("Things are not okay. AuxiliaryB\n");
+    }
+    // Banks that ran out of thermistors don't care about this channel
+    for (int i = 0; i < BMS_BANK_COUNT; i++) {
+      if ((failed & (1u << i)) && j < kPackTopology.thermistorCount(i)) {
+        m_snapshot.staleTemperatureBanks |= 1u << i;
+      }
+    }
+  }
+}
+
+template <typename Chip>
+void BMSThread<Chip>::checkStaleBanks() {
+  uint32_t stale = m_snapshot.staleVoltageBanks | m_snapshot.staleTemperatureBanks;
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (!(stale & (1u << i))) {
+      m_staleScans[i] = 0;
+      continue;
+    }
+    if (m_staleScans[i] < BMS_STALE_SCAN_LIMIT) {
+      m_staleScans[i]++;
+      if (m_staleScans[i] == BMS_STALE_SCAN_LIMIT) {
+        printf("Things are not okay. Bank %d not read for %d scans\n", i, BMS_STALE_SCAN_LIMIT);
+        bmsState = BMSThreadState::BMSFault;
+      }
+    }
+  }
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::decodeTemperature(uint8_t channel, unsigned int bank,
+                                        const uint8_t *rawAux) {
+  if (!checkPec15(rawAux, 6)) {
+    return false;
+  }
+  // Banks with fewer thermistors still step their mux along with the rest
+  if (channel < kPackTopology.thermistorCount(bank)) {
+    uint16_t tempVoltage = ((uint16_t)rawAux[0]) | ((uint16_t)rawAux[1] << 8);
+    m_snapshot.cellTemperatures[kPackTopology.thermistorOffset(bank) + channel] =
+        convertTemp(tempVoltage / 10);
+  }
+  return true;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::decodeVoltageGroup(uint8_t group, unsigned int bank,
+                                         const uint8_t *rawGroup) {
+  if (!checkPec15(rawGroup, 6)) {
+    return false;
+  }
+
+  // The discharge state is still the one the cells were converted with
+  uint32_t discharging = m_chips[bank].getConfig().dischargeState.value;
+
+  // Only the connected cells of this bank in this group, in one run from the
+  // topology
+  unsigned int run = group * BMS_BANK_COUNT + bank;
+  for (unsigned int k = kSlotStarts[run]; k < kSlotStarts[run + 1]; k++) {
+    const CellSlot &slot = kGroupedCellSlots[k];
+
+    // Three cells per register group, little endian
+    const uint8_t *raw = &rawGroup[(slot.pin % 3) * 2];
+    uint16_t voltage = (((uint16_t)raw[0]) | ((uint16_t)raw[1] << 8)) / 10;
+    if (kDischargePermitted && discharging != 0) {
+      voltage = removeBalanceDrops(voltage, bank, slot.pin, discharging);
+    }
+    m_snapshot.cellVoltages[slot.cell] = voltage;
+  }
+  return true;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::scanTemperaturesPerChip() {
+  // One task per bank, so each chip converts while the others are being
+  // written to or read back
+  AdcMode mode = applyAdcSettings(AdcPurpose::kTemperature);
+  std::vector<BankTemperatureScan> scans;
+  scans.reserve(BMS_BANK_COUNT);
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (kPackTopology.thermistorCount(i) == 0) {
+      continue;
+    }
+    scans.emplace_back(*this, i, mode);
+    m_executor.add(&scans.back());
+  }
+  m_executor.run();
+}
+
+template <typename Chip>
+BMSThread<Chip>::BankTemperatureScan::BankTemperatureScan(BMSThread &bms, uint8_t bank,
+                                                          AdcMode mode)
+    : m_bms(bms), m_bank(bank), m_mode(mode) {}
+
+template <typename Chip>
+std::optional<std::chrono::microseconds>
+BMSThread<Chip>::BankTemperatureScan::step(std::chrono::microseconds now) {
+  switch (m_state) {
+    case State::kSelectChannel: {
+      // MUX get temp from each cell
+      setMuxChannel(m_bms.m_chips[m_bank].getConfig(), m_channel);
+      m_bms.m_configs.flush();
+
+      auto gpioADCcmd = StartGpioADC(m_mode, GpioSelection::k4);
+      if (m_bms.m_bus.SendCommand(LTC681xBus::BuildAddressedBusCommand(
+              gpioADCcmd, m_bank)) != LTC681xBus::LTC681xBusStatus::Ok) {
+        printf("Things are not okay. StartGPIO ADC\n");
+      }
+
+      auto expected = conversionTime<typename Chip::Variant>(
+          AdcConversion::kGpioSingle, m_mode, m_bms.m_chips[m_bank].getConfig().adcMode);
+      m_deadline = now + expected + conversionTimeout(expected);
+      m_state = State::kConverting;
+      return expected;
+    }
+
+    case State::kConverting: {
+      bool done = m_bms.m_bus.PollAdcCompletion(LTC681xBus::BuildAddressedBusCommand(
+                      PollADCStatus(), m_bank)) == LTC681xBus::LTC681xBusStatus::Ok;
+      if (!done && now < m_deadline) {
+        return kPollInterval;
+      }
+      if (!done) {
+        printf("Poll timeout. GPIO\n");
+      }
+
+      // GPIO4 is the first value of auxiliary group B, group A isn't needed
+      uint8_t rxbuf[8];
+      if (m_bms.m_bus.SendReadCommand(
+              LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupB(), m_bank),
+              rxbuf) != LTC681xBus::LTC681xBusStatus::Ok) {
+        // Nothing came back to decode, and the rest of the bank's channels
+        // would go the same way
+        printf("Things are not okay. AuxiliaryB\n");
+        m_bms.recordLinkErrors(m_bank, 1, true);
+        m_bms.m_snapshot.staleTemperatureBanks |= 1u << m_bank;
+        return std::nullopt;
+      }
+
+      // A corrupted reading keeps the temperature from the last scan
+      if (!m_bms.decodeTemperature(m_channel, m_bank, rxbuf)) {
+        printf("Things are not okay. AuxiliaryB PEC\n");
+        m_bms.recordLinkErrors(m_bank, 1, false);
+        m_bms.m_snapshot.staleTemperatureBanks |= 1u << m_bank;
+      }
+
+      m_channel++;
+      m_state = State::kSelectChannel;
+      if (m_channel >= kPackTopology.thermistorCount(m_bank)) {
+        return std::nullopt;
+      }
+      return std::chrono::microseconds(0);
     }
+  }
+  return std::nullopt;
+}
 
-    if (!bmsEventMailbox->full()) {
-        BmsEvent* msg = new BmsEvent();
-        for (int i = 0; i < BMS_BANK_COUNT*BMS_BANK_CELL_COUNT; i++) {
-            msg->voltageValues[i] = allVoltages[i];
+template <typename Chip>
+BMSThread<Chip>::OpenWireCheck::OpenWireCheck(BMSThread &bms)
+    : m_bms(bms), m_mode(AdcMode::k7k), m_nextStep(Kernel::Clock::now()), m_nextCheck(m_nextStep) {}
+
+template <typename Chip>
+bool BMSThread<Chip>::OpenWireCheck::fitsBefore(Kernel::Clock::time_point deadline) const {
+  // A pull in progress was let in together with the rest of its conversions
+  if (m_state == State::kConverting) {
+    return true;
+  }
+  auto conversion = pullConversionTime();
+  auto pull = kPullConversions * (conversion + conversionTimeout(conversion)) + kReadBackTime;
+  return std::max(m_nextStep, Kernel::Clock::now()) + pull <= deadline;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::OpenWireCheck::step() {
+  m_bms.wakeupBus();
+
+  switch (m_state) {
+    case State::kWaiting:
+      if (m_pullUp) {
+        m_failed = 0;
+      }
+      m_mode = m_bms.applyAdcSettings(AdcPurpose::kOpenWire);
+      m_bms.m_configs.flush();
+      m_conversions = 0;
+      if (!startPull()) {
+        printf("Things are not okay. StartOpenWire\n");
+      }
+      return;
+
+    case State::kConverting: {
+      bool done = m_bms.pollConversion(banks());
+      auto now = Kernel::Clock::now();
+      if (!done && now < m_deadline) {
+        m_nextStep = now + std::chrono::ceil<std::chrono::milliseconds>(kPollInterval);
+        return;
+      }
+      if (!done) {
+        // Cell health stays as it was, the next check starts over
+        printf("Poll timeout. OpenWire\n");
+        finishCheck();
+        return;
+      }
+
+      m_conversions++;
+      if (m_conversions < kPullConversions) {
+        if (!startPull()) {
+          printf("Things are not okay. StartOpenWire\n");
         }
-        for (int i = 0; i < BMS_BANK_COUNT*BMS_BANK_TEMP_COUNT; i++) {
-            msg->temperatureValues[i] = allTemps[i];
+        return;
+      }
+
+      readBack();
+      if (m_pullUp) {
+        // Pulling down waits for a slot of its own
+        m_pullUp = false;
+        m_state = State::kWaiting;
+        m_nextStep = now;
+        return;
+      }
+      evaluate();
+      finishCheck();
+      return;
+    }
+  }
+}
+
+template <typename Chip>
+void BMSThread<Chip>::OpenWireCheck::interrupted() {
+  if (m_state == State::kConverting) {
+    m_state = State::kWaiting;
+    m_nextStep = Kernel::Clock::now();
+  }
+}
+
+template <typename Chip>
+uint32_t BMSThread<Chip>::OpenWireCheck::banks() const {
+  return m_bms.m_chains.empty() ? 1u << m_bank : LTC6811ChainBus::kAllChips;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::OpenWireCheck::startPull() {
+  auto expected = pullConversionTime();
+  auto now = Kernel::Clock::now();
+  m_nextStep = now + std::chrono::ceil<std::chrono::milliseconds>(expected);
+  m_deadline = now + std::chrono::ceil<std::chrono::milliseconds>(expected + conversionTimeout(expected));
+  m_state = State::kConverting;
+
+  if (!m_bms.m_chains.empty()) {
+    const ModeFrames &frames = m_pullUp ? kOpenWirePullUpFrames : kOpenWirePullDownFrames;
+    bool ok = true;
+    for (LTC6811ChainBus *chain : m_bms.m_chains) {
+      ok = chain->SendCommand(frames[(uint8_t)m_mode & 0b11]) == LTC6811ChainBus::Status::Ok && ok;
+    }
+    return ok;
+  }
+
+  return m_bms.m_bus.SendCommand(LTC681xBus::BuildAddressedBusCommand(
+             StartOpenWireConversion(m_mode, m_pullUp, false, CellSelection::kAll), m_bank)) ==
+         LTC681xBus::LTC681xBusStatus::Ok;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::OpenWireCheck::readBack() {
+  m_bms.m_retryBudget = BMS_READ_RETRY_BUDGET;
+
+  auto &values = m_pullUp ? m_pulledUp : m_pulledDown;
+  for (uint8_t group = 0; group < kCellGroupCount; group++) {
+    auto decode = [&values, group](unsigned int bank, const uint8_t *rawGroup) {
+      if (!checkPec15(rawGroup, 6)) {
+        return false;
+      }
+      for (unsigned int k = 0; k < 3; k++) {
+        values[bank][group * 3 + k] =
+            ((uint16_t)rawGroup[k * 2]) | ((uint16_t)rawGroup[k * 2 + 1] << 8);
+      }
+      return true;
+    };
+
+    uint32_t failed = 0;
+    if (!m_bms.readRegisterGroup(kCellVoltageGroups[group], decode, &failed, banks())) {
+      printf("Things are not okay. OpenWire%c\n", 'A' + group);
+    }
+    m_failed |= failed;
+  }
+}
+
+template <typename Chip>
+void BMSThread<Chip>::OpenWireCheck::evaluate() {
+  uint32_t checked = banks() & ~m_failed;
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (!(checked & (1u << i))) {
+      continue;
+    }
+
+    // Unconnected pins are shorted and read 0V either way, so only compare
+    // connected cells, each against the connected cell below it
+    uint32_t pins = kPackTopology.cellPins(i);
+    uint32_t open = 0;
+    int below = -1;
+    for (unsigned int pin = 0; pin < kCellCount; pin++) {
+      if (!(pins & (1u << pin))) {
+        continue;
+      }
+      if (below < 0) {
+        // Bottom wire of the bank, reads 0V pulled up when open
+        if (m_pulledUp[i][pin] == 0) {
+          open |= 1u << pin;
         }
-        msg->bmsState = bmsState;
-        msg->isBalancing = isBalancing;
-        msg->minVolt = (uint8_t)(minVoltage*50/1000.0);
-        msg->maxVolt = (uint8_t)(maxVoltage*50/1000.0);
-        msg->minTemp = minTemp;
-        msg->maxTemp = maxTemp;
-        msg->avgTemp = avgTemp;
-        bmsEventMailbox->put((BmsEvent *)msg);
+      } else if ((int32_t)m_pulledUp[i][pin] - m_pulledDown[i][pin] < kOpenWireDelta) {
+        // The wire between this cell and the one below, both lose it
+        open |= (1u << pin) | (1u << below);
+      }
+      below = pin;
+    }
+    // Top wire of the bank, reads 0V pulled down when open
+    if (below >= 0 && m_pulledDown[i][below] == 0) {
+      open |= 1u << below;
+    }
+
+    for (unsigned int pin = 0; pin < kCellCount; pin++) {
+      if (!(pins & (1u << pin))) {
+        continue;
+      }
+      uint8_t &health = m_bms.m_snapshot.cellHealth[kPackTopology.cellIndex(i, pin)];
+      if (open & (1u << pin)) {
+        if (!(health & PackSnapshot::kOpenWire)) {
+          printf("Open wire bank %d cell pin %u\n", i, pin + 1);
+        }
+        health |= PackSnapshot::kOpenWire;
+      } else {
+        health &= ~PackSnapshot::kOpenWire;
+      }
+    }
+  }
+}
+
+template <typename Chip>
+std::chrono::microseconds BMSThread<Chip>::OpenWireCheck::pullConversionTime() const {
+  // ADOW takes as long as ADCV
+  AdcSettings settings = selectAdcSettings(AdcPurpose::kOpenWire, false);
+  return ::conversionTime<typename Chip::Variant>(AdcConversion::kCellVoltage, settings.mode,
+                                                  settings.option);
+}
+
+template <typename Chip>
+void BMSThread<Chip>::OpenWireCheck::finishCheck() {
+  m_pullUp = true;
+  m_state = State::kWaiting;
+
+  // Spread the banks over the period, a daisy chain checks all of them at once
+  unsigned int checks = 1;
+  if (m_bms.m_chains.empty()) {
+    m_bank = (m_bank + 1) % BMS_BANK_COUNT;
+    checks = BMS_BANK_COUNT;
+  }
+
+  // A check that had to wait for a slot doesn't make the next one come sooner
+  auto now = Kernel::Clock::now();
+  m_nextCheck += std::chrono::milliseconds(BMS_OPEN_WIRE_PERIOD) / checks;
+  if (m_nextCheck < now) {
+    m_nextCheck = now;
+  }
+  m_nextStep = m_nextCheck;
+}
+
+template <typename Chip>
+BMSThread<Chip>::SelfTestCheck::SelfTestCheck(BMSThread &bms)
+    : m_bms(bms), m_mode(AdcMode::k7k), m_nextStep(Kernel::Clock::now()), m_nextTest(m_nextStep) {}
+
+template <typename Chip>
+bool BMSThread<Chip>::SelfTestCheck::fitsBefore(Kernel::Clock::time_point deadline) const {
+  // A test in progress was let in together with its read back
+  if (m_state == State::kConverting) {
+    return true;
+  }
+  auto conversion = testTime();
+  auto test = conversion + conversionTimeout(conversion) + kReadBackTime;
+  return std::max(m_nextStep, Kernel::Clock::now()) + test <= deadline;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::SelfTestCheck::step() {
+  m_bms.wakeupBus();
+
+  switch (m_state) {
+    case State::kWaiting:
+      m_mode = m_bms.applyAdcSettings(AdcPurpose::kSelfTest);
+      m_bms.m_configs.flush();
+      if (!startTest()) {
+        printf("Things are not okay. StartSelfTest\n");
+      }
+      return;
+
+    case State::kConverting: {
+      bool done = m_bms.pollConversion(LTC6811ChainBus::kAllChips);
+      auto now = Kernel::Clock::now();
+      if (!done && now < m_deadline) {
+        m_nextStep = now + std::chrono::ceil<std::chrono::milliseconds>(kPollInterval);
+        return;
+      }
+      if (!done) {
+        printf("Poll timeout. SelfTest\n");
+      } else {
+        readBack();
+      }
+      finishTest();
+      return;
+    }
+  }
+}
+
+template <typename Chip>
+void BMSThread<Chip>::SelfTestCheck::interrupted() {
+  if (m_state == State::kConverting) {
+    m_state = State::kWaiting;
+    m_nextStep = Kernel::Clock::now();
+  }
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::SelfTestCheck::startTest() {
+  auto expected = testTime();
+  auto now = Kernel::Clock::now();
+  m_nextStep = now + std::chrono::ceil<std::chrono::milliseconds>(expected);
+  m_deadline = now + std::chrono::ceil<std::chrono::milliseconds>(expected + conversionTimeout(expected));
+  m_state = State::kConverting;
+
+  switch (m_test) {
+    case Test::kCellSelfTest: return m_bms.startConversion(Conversion::kSelfTestCellVoltage, m_mode);
+    case Test::kGpioSelfTest: return m_bms.startConversion(Conversion::kSelfTestGpio, m_mode);
+    case Test::kAdcOverlap: return m_bms.startConversion(Conversion::kOverlap, m_mode);
+    case Test::kMux: return m_bms.startConversion(Conversion::kDiagnoseMux, m_mode);
+  }
+  return false;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::SelfTestCheck::readBack() {
+  m_bms.m_retryBudget = BMS_READ_RETRY_BUDGET;
+
+  // Chips that fail the test, and chips that couldn't be read back at all
+  uint32_t failed = 0;
+  uint32_t unread = 0;
+  uint32_t readFailed = 0;
+
+  AdcSettings settings = selectAdcSettings(AdcPurpose::kSelfTest, false);
+  uint16_t code = selfTestCode(settings.mode, settings.option, SelfTestMode::kSelfTest1);
+  auto checkCodes = [&failed, code](unsigned int bank, const uint8_t *rawGroup) {
+    if (!checkPec15(rawGroup, 6)) {
+      return false;
+    }
+    for (unsigned int k = 0; k < 3; k++) {
+      uint16_t value = ((uint16_t)rawGroup[k * 2]) | ((uint16_t)rawGroup[k * 2 + 1] << 8);
+      if (value != code) {
+        failed |= 1u << bank;
+      }
+    }
+    return true;
+  };
+
+  uint8_t test = 0;
+  const char *name = "";
+  switch (m_test) {
+    case Test::kCellSelfTest:
+      test = ChipDiagnostics::kCellSelfTest;
+      name = "CVST";
+      for (uint8_t group = 0; group < kCellGroupCount; group++) {
+        if (!m_bms.readRegisterGroup(kCellVoltageGroups[group], checkCodes, &readFailed)) {
+          printf("Things are not okay. SelfTestVoltage%c\n", 'A' + group);
+        }
+        unread |= readFailed;
+      }
+      break;
+
+    case Test::kGpioSelfTest:
+      // GPIO1-5 and the second reference
+      test = ChipDiagnostics::kGpioSelfTest;
+      name = "AXST";
+      if (!m_bms.readRegisterGroup(RegisterGroup::kAuxiliaryA, checkCodes, &readFailed)) {
+        printf("Things are not okay. SelfTestGpioA\n");
+      }
+      unread |= readFailed;
+      if (!m_bms.readRegisterGroup(RegisterGroup::kAuxiliaryB, checkCodes, &readFailed)) {
+        printf("Things are not okay. SelfTestGpioB\n");
+      }
+      unread |= readFailed;
+      break;
+
+    case Test::kAdcOverlap: {
+      // Cell 7 ends up in the cell 7 and cell 8 registers, one from each ADC
+      test = ChipDiagnostics::kAdcOverlap;
+      name = "ADOL";
+      auto compare = [&failed](unsigned int bank, const uint8_t *rawGroup) {
+        if (!checkPec15(rawGroup, 6)) {
+          return false;
+        }
+        int32_t first = ((uint16_t)rawGroup[0]) | ((uint16_t)rawGroup[1] << 8);
+        int32_t second = ((uint16_t)rawGroup[2]) | ((uint16_t)rawGroup[3] << 8);
+        if (std::abs(first - second) > kOverlapTolerance) {
+          failed |= 1u << bank;
+        }
+        return true;
+      };
+      if (!m_bms.readRegisterGroup(RegisterGroup::kCellVoltageC, compare, &readFailed)) {
+        printf("Things are not okay. OverlapC\n");
+      }
+      unread |= readFailed;
+      break;
     }
 
+    case Test::kMux: {
+      test = ChipDiagnostics::kMux;
+      name = "DIAGN";
+      auto checkMux = [&failed](unsigned int bank, const uint8_t *rawStatus) {
+        if (!checkPec15(rawStatus, 6)) {
+          return false;
+        }
+        // MUXFAIL
+        if (rawStatus[5] & 0x02) {
+          failed |= 1u << bank;
+        }
+        return true;
+      };
+      if (!m_bms.readRegisterGroup(RegisterGroup::kStatusB, checkMux, &readFailed)) {
+        printf("Things are not okay. MuxStatusB\n");
+      }
+      unread |= readFailed;
+      break;
+    }
+  }
+
+  // A chip that failed part of the test fails it, even if the rest couldn't
+  // be read
+  uint32_t all = BMS_BANK_COUNT < 32 ? (1u << BMS_BANK_COUNT) - 1 : LTC6811ChainBus::kAllChips;
+  m_bms.recordSelfTest(test, name, (all & ~unread) | failed, failed);
+}
 
-    if (charging) {
-        ThisThread::sleep_for(500ms); // longer duty cycle when charging, 500 default
+template <typename Chip>
+std::chrono::microseconds BMSThread<Chip>::SelfTestCheck::testTime() const {
+  AdcConversion conversion = AdcConversion::kCellVoltage;
+  switch (m_test) {
+    case Test::kCellSelfTest: conversion = AdcConversion::kCellVoltage; break;
+    case Test::kGpioSelfTest: conversion = AdcConversion::kGpioAll; break;
+    // A single cell, on two ADCs at once
+    case Test::kAdcOverlap: conversion = AdcConversion::kCellPair; break;
+    // Not in the conversion time table, it is polled until done anyway
+    case Test::kMux: conversion = AdcConversion::kGpioSingle; break;
+  }
+  AdcSettings settings = selectAdcSettings(AdcPurpose::kSelfTest, false);
+  return ::conversionTime<typename Chip::Variant>(conversion, settings.mode, settings.option);
+}
+
+template <typename Chip>
+void BMSThread<Chip>::SelfTestCheck::finishTest() {
+  m_state = State::kWaiting;
+  m_test = (Test)(((unsigned int)m_test + 1) % kTestCount);
+
+  if (m_test == Test::kCellSelfTest) {
+    if (m_bms.m_bootTimings.selfTests.count() == 0) {
+      m_bms.m_bootTimings.selfTests = sinceBoot();
+      printf("SELF TEST DONE\n");
+    }
+    if (BMS_SELF_TEST_PERIOD == 0) {
+      // Only the startup round
+      m_nextStep = Kernel::Clock::time_point::max();
+      return;
+    }
+  }
+
+  // A test that had to wait for a slot doesn't make the next one come sooner
+  auto now = Kernel::Clock::now();
+  m_nextTest += std::chrono::milliseconds(BMS_SELF_TEST_PERIOD) / kTestCount;
+  if (m_nextTest < now) {
+    m_nextTest = now;
+  }
+  m_nextStep = m_nextTest;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::measureDieTemperatures() {
+  AdcMode mode = applyAdcSettings(AdcPurpose::kTemperature);
+  m_configs.flush();
+
+  if (!startConversion(Conversion::kDieTemperature, mode)) {
+    printf("Things are not okay. StartStatusADC\n");
+    return;
+  }
+  if (!waitForConversion(AdcConversion::kSumOfCells, mode)) {
+    printf("Poll timeout. DieTemperature\n");
+    return;
+  }
+
+  // ITMP is bytes 2-3 of status group A, 7.5mV per kelvin
+  auto decode = [this](unsigned int bank, const uint8_t *rawStatus) {
+    if (!checkPec15(rawStatus, 6)) {
+      return false;
+    }
+    uint16_t itmp = ((uint16_t)rawStatus[2]) | ((uint16_t)rawStatus[3] << 8);
+    m_snapshot.dieTemperatures[bank] = (int8_t)std::min(itmp / 75 - 273, 127);
+    return true;
+  };
+  if (!readRegisterGroup(RegisterGroup::kStatusA, decode)) {
+    printf("Things are not okay. DieTemperature\n");
+  }
+}
+
+template <typename Chip>
+void BMSThread<Chip>::samplePackVoltage() {
+  m_retryBudget = BMS_READ_RETRY_BUDGET;
+  wakeupBus();
+
+  AdcMode mode = applyAdcSettings(AdcPurpose::kPackVoltage);
+  m_configs.flush();
+
+  if (!startConversion(Conversion::kSumOfCells, mode)) {
+    printf("Things are not okay. StartStatus ADC\n");
+    return;
+  }
+
+  if (!waitForConversion(AdcConversion::kSumOfCells, mode)) {
+    printf("Poll timeout. Status\n");
+    return;
+  }
+  // The reading is as old as the conversion, not as the read back or the mail
+  auto timestamp = Kernel::Clock::now();
+
+  uint32_t packVoltage = 0;
+  auto decode = [&packVoltage](unsigned int bank, const uint8_t *rawStatus) {
+    return addSumOfCells(rawStatus, packVoltage);
+  };
+  if (!readRegisterGroup(RegisterGroup::kStatusA, decode)) {
+    printf("Things are not okay. StatusA\n");
+    return;
+  }
+
+  // A reading far from what the cells added up to last scan means one of the
+  // two measurements is off
+  uint32_t difference = packVoltage > m_lastCellSum ? packVoltage - m_lastCellSum
+                                                    : m_lastCellSum - packVoltage;
+  bool plausible = difference <= BMS_PACK_VOLTAGE_TOLERANCE;
+  // This runs every BMS_PACK_VOLTAGE_PERIOD, only print when it changes
+  if (plausible != m_packVoltagePlausible) {
+    if (!plausible) {
+      printf("Pack voltage mismatch: %lu mV vs %lu mV\n", (unsigned long)packVoltage,
+             (unsigned long)m_lastCellSum);
     } else {
-        ThisThread::sleep_for(100ms); // 100 ms
+      printf("Pack voltage matches again\n");
     }
-    if (bmsState == BMSThreadState::BMSFaultRecover) {
-        bmsState = BMSThreadState::BMSIdle;
+    m_packVoltagePlausible = plausible;
+  }
+
+  if (PackVoltageEvent* msg = packVoltageMailbox->try_alloc()) {
+    msg->packVoltage = packVoltage;
+    msg->timestamp = timestamp;
+    msg->plausible = plausible;
+    packVoltageMailbox->put(msg);
+  }
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::pollVoltageFlags(Suspects &flagged) {
+  m_retryBudget = BMS_READ_RETRY_BUDGET;
+  wakeupBus();
+
+  // The comparators only update as part of a cell conversion
+  AdcMode mode = applyAdcSettings(AdcPurpose::kVoltageFlags);
+  m_configs.flush();
+
+  if (!startConversion(Conversion::kCellVoltage, mode)) {
+    printf("Things are not okay. StartADC\n");
+    return false;
+  }
+
+  if (!waitForConversion(AdcConversion::kCellVoltage, mode)) {
+    printf("Poll timeout. VoltageFlags\n");
+    return false;
+  }
+
+  // Flags of cells 1-12 are in bytes 2-4 of status group B, cells 13-18 in
+  // bytes 4-5 of auxiliary group D
+  uint32_t undervoltage[BMS_BANK_COUNT] = {};
+  uint32_t overvoltage[BMS_BANK_COUNT] = {};
+  auto decodeStatus = [&undervoltage, &overvoltage](unsigned int bank, const uint8_t *rawStatus) {
+    if (!checkPec15(rawStatus, 6)) {
+      return false;
+    }
+    addVoltageFlags(rawStatus + 2, 0, std::min(kCellCount, 12u), undervoltage[bank],
+                    overvoltage[bank]);
+    return true;
+  };
+  if (!readRegisterGroup(RegisterGroup::kStatusB, decodeStatus)) {
+    printf("Things are not okay. StatusB\n");
+  }
+
+  if constexpr (kCellCount > 12) {
+    auto decodeAux = [&undervoltage, &overvoltage](unsigned int bank, const uint8_t *rawAux) {
+      if (!checkPec15(rawAux, 6)) {
+        return false;
+      }
+      addVoltageFlags(rawAux + 4, 12, kCellCount - 12, undervoltage[bank], overvoltage[bank]);
+      return true;
+    };
+    if (!readRegisterGroup(RegisterGroup::kAuxiliaryD, decodeAux)) {
+      printf("Things are not okay. AuxiliaryD\n");
+    }
+  }
+
+  // Pins with nothing connected sit at 0V and always flag undervoltage
+  bool any = false;
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    uint32_t pins = kPackTopology.cellPins(i);
+    flagged.cellPins[i] = (undervoltage[i] | overvoltage[i]) & pins;
+    if (flagged.cellPins[i]) {
+      printf("Voltage flags bank %d: UV %lx, OV %lx\n", i,
+             (unsigned long)(undervoltage[i] & pins), (unsigned long)(overvoltage[i] & pins));
+      any = true;
     }
   }
+  return any;
 }
 
-void BMSThread::throwBmsFault() {
-    //bmsState = BMSThreadState::BMSFault;
-}
\ No newline at end of file
+template <typename Chip>
+bool BMSThread<Chip>::waitForNextScan(Kernel::Clock::time_point nextScan, Suspects &flagged) {
+  // Pack voltage keeps precharge and current limits fresh, the comparators
+  // catch cells going out of range between full scans
+  //
+  // Parked, only the comparators run, at their own slower period
+  std::chrono::milliseconds packPeriod(parked ? 0 : BMS_PACK_VOLTAGE_PERIOD);
+  std::chrono::milliseconds flagPeriod(parked ? BMS_PARKED_VOLTAGE_FLAG_PERIOD
+                                              : BMS_VOLTAGE_FLAG_PERIOD);
+
+  // The full scan converted since, if the last wait was cut short in the
+  // middle of a diagnostic
+  m_diagnostics.interrupted();
+
+  auto now = Kernel::Clock::now();
+  auto nextPack = now + packPeriod;
+  auto nextFlags = now + flagPeriod;
+  while (true) {
+    auto next = nextScan;
+    if (packPeriod.count() > 0 && nextPack < next) {
+      next = nextPack;
+    }
+    if (flagPeriod.count() > 0 && nextFlags < next) {
+      next = nextFlags;
+    }
+    // Diagnostics only get the bus if they are done before anything else is
+    // due, so they never delay the rest. They wait until the car is unparked.
+    DiagnosticTask *diagnostic = parked ? nullptr : m_diagnostics.next(next);
+    if (diagnostic) {
+      next = diagnostic->nextStep();
+    }
+    if (next == nextScan) {
+      break;
+    }
+
+    if (sleepUntil(next)) {
+      return false;
+    }
+    if (diagnostic) {
+      diagnostic->step();
+      continue;
+    }
+    if (flagPeriod.count() > 0 && next == nextFlags) {
+      nextFlags += flagPeriod;
+      if (pollVoltageFlags(flagged)) {
+        return true;
+      }
+    }
+    if (packPeriod.count() > 0 && next == nextPack) {
+      nextPack += packPeriod;
+      samplePackVoltage();
+    }
+  }
+
+  sleepUntil(nextScan);
+  return false;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::applyMainEvent(MainToBMSEvent *event) {
+  bool woke = parked && !event->parked;
+  balanceAllowed = event->balanceAllowed;
+  charging = event->charging;
+  parked = event->parked;
+  delete event;
+  return woke;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::sleepUntil(Kernel::Clock::time_point until) {
+  // The chips go to sleep and reset their configuration after 1.8s without a
+  // command. Timed from here rather than from the last command, so leave some
+  // margin.
+  constexpr auto watchdogTimeout = 1500ms;
+
+  auto start = Kernel::Clock::now();
+  bool woke = false;
+  if (parked) {
+    MainToBMSEvent *event;
+    while (!woke) {
+      // Signed until it is known to be positive
+      auto remaining = until - Kernel::Clock::now();
+      if (remaining <= remaining.zero() ||
+          !mainToBMSMailbox->try_get_for(
+              std::chrono::duration_cast<Kernel::Clock::duration_u32>(remaining), &event)) {
+        break;
+      }
+      woke = applyMainEvent(event);
+    }
+  } else {
+    ThisThread::sleep_until(until);
+  }
+
+  if (Kernel::Clock::now() - start >= watchdogTimeout) {
+    m_configs.invalidate();
+  }
+  return woke;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::voltageOutOfRange(uint16_t voltage) const {
+  return voltage <= BMS_FAULT_VOLTAGE_THRESHOLD_LOW || voltage >= BMS_FAULT_VOLTAGE_THRESHOLD_HIGH;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::temperatureOutOfRange(int8_t temperature) const {
+  return temperature <= BMS_FAULT_TEMP_THRESHOLD_LOW ||
+         temperature >= ((charging) ? BMS_FAULT_TEMP_THRESHOLD_CHARING_HIGH : BMS_FAULT_TEMP_THRESHOLD_HIGH);
+}
+
+template <typename Chip>
+typename BMSThread<Chip>::Suspects BMSThread<Chip>::findSuspects() const {
+  Suspects suspects;
+  for (const CellSlot &slot : kCellSlots) {
+    suspects.cellPins[slot.bank] |=
+        (uint32_t)voltageOutOfRange(m_snapshot.cellVoltages[slot.cell]) << slot.pin;
+  }
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    auto temps = m_snapshot.bankTemperatures(i);
+    for (ptrdiff_t j = 0; j < temps.size(); j++) {
+      suspects.thermistors[i] |= (uint8_t)temperatureOutOfRange(temps[j]) << j;
+    }
+  }
+  return suspects;
+}
+
+template <typename Chip>
+bool BMSThread<Chip>::confirmFault(const Suspects &suspects) {
+  m_retryBudget = BMS_READ_RETRY_BUDGET;
+  wakeupBus();
+
+  uint32_t suspectPins = 0;
+  uint8_t suspectChannels = 0;
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    suspectPins |= suspects.cellPins[i];
+    suspectChannels |= suspects.thermistors[i];
+  }
+
+  if (suspectPins != 0) {
+    // Convert only the CH selections holding a suspect cell, then read back
+    // only the groups holding them from the banks they are on. Conversions
+    // leave the registers of other cells alone, so all of them can run first.
+    AdcMode mode = applyAdcSettings(AdcPurpose::kCellVoltage);
+    m_configs.flush();
+    for (uint8_t pair = 0; pair < 6; pair++) {
+      if (!(suspectPins & (0b1000001000001u << pair))) {
+        continue;
+      }
+      if (!startCellPairConversion(pair, mode)) {
+        printf("Things are not okay. StartADC\n");
+      }
+      if (!waitForConversion(AdcConversion::kCellPair, mode)) {
+        printf("Poll timeout. Confirm\n");
+      }
+    }
+
+    for (uint8_t group = 0; group < kCellGroupCount; group++) {
+      uint32_t banks = 0;
+      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+        banks |= (uint32_t)((suspects.cellPins[i] & (0b111u << (group * 3))) != 0) << i;
+      }
+      if (banks == 0) {
+        continue;
+      }
+      auto decode = [this, group](unsigned int bank, const uint8_t *rawGroup) {
+        return decodeVoltageGroup(group, bank, rawGroup);
+      };
+      if (!readRegisterGroup(kCellVoltageGroups[group], decode, nullptr, banks)) {
+        printf("Things are not okay. Voltage%c\n", 'A' + group);
+      }
+    }
+  }
+
+  if (suspectChannels != 0) {
+    // Only the mux channels with a suspect thermistor, read back from the
+    // banks they are on
+    AdcMode mode = applyAdcSettings(AdcPurpose::kTemperature);
+    for (uint8_t channel = 0; channel < 8; channel++) {
+      uint32_t banks = 0;
+      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+        banks |= (uint32_t)((suspects.thermistors[i] >> channel) & 1) << i;
+      }
+      if (banks == 0) {
+        continue;
+      }
+
+      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+        setMuxChannel(m_chips[i].getConfig(), channel);
+      }
+      m_configs.flush();
+      if (!startConversion(Conversion::kThermistor, mode)) {
+        printf("Things are not okay. StartGPIO ADC\n");
+      }
+      if (!waitForConversion(AdcConversion::kGpioSingle, mode)) {
+        printf("Poll timeout. GPIO\n");
+      }
+      auto decode = [this, channel](unsigned int bank, const uint8_t *rawAux) {
+        return decodeTemperature(channel, bank, rawAux);
+      };
+      if (!readRegisterGroup(RegisterGroup::kAuxiliaryB, decode, nullptr, banks)) {
+        printf("Things are not okay. AuxiliaryB\n");
+      }
+    }
+  }
+
+  // A chip that couldn't be read again keeps its out of range value, so it
+  // still counts
+  bool confirmed = false;
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    for (unsigned int pin = 0; pin < kCellCount; pin++) {
+      if (suspects.cellPins[i] & (1u << pin)) {
+        uint16_t voltage = m_snapshot.cellVoltages[kPackTopology.cellIndex(i, pin)];
+        if (voltageOutOfRange(voltage)) {
+          printf("Bank %d cell pin %u confirmed: %d mV\n", i, pin + 1, voltage);
+          confirmed = true;
+        }
+      }
+    }
+    auto temps = m_snapshot.bankTemperatures(i);
+    for (ptrdiff_t j = 0; j < temps.size(); j++) {
+      if ((suspects.thermistors[i] & (1u << j)) && temperatureOutOfRange(temps[j])) {
+        printf("Bank %d thermistor %d confirmed: %d C\n", i, (int)j, temps[j]);
+        confirmed = true;
+      }
+    }
+  }
+  return confirmed;
+}
+
+template <typename Chip>
+void BMSThread<Chip>::recoverFault(const Suspects &suspects) {
+  // A bank that stopped answering latches the fault, the readings left
+  // can't clear it
+  if (bmsState == BMSThreadState::BMSFault) {
+    return;
+  }
+  printf("ENTERING FAULT RECOVERY\n");
+  bmsState = BMSThreadState::BMSFaultRecover;
+  if (confirmFault(suspects)) {
+    printf("FAULT STATE\n");
+    throwBmsFault();
+  } else {
+    printf("FAULT CLEARED\n");
+    bmsState = BMSThreadState::BMSIdle;
+  }
+}
+
+template class BMSThread<BmsChip>;
+
@@ -14,15 +14,37 @@
 #include "BmsConfig.h"
 //#include "Can.h"
 
+#include "AdcConversion.h"
+#include "BalancePlanner.h"
+#include "ConfigManager.h"
+#include "DiagnosticScheduler.h"
 #include "EnergusTempSensor.h"
 #include "LTC6811.h"
+#include "LTC6811ChainBus.h"
 #include "LTC681xBus.h"
 #include "Event.h"
+#include "PackSnapshot.h"
+#include "ScanExecutor.h"
 
+#if BMS_MONITOR == 6811
+using BmsChip = LTC6811;
+#elif BMS_MONITOR == 6812
+using BmsChip = LTC6812;
+#elif BMS_MONITOR == 6813
+using BmsChip = LTC6813;
+#else
+#error "BMS_MONITOR must be 6811, 6812 or 6813"
+#endif
+
+// Chip: LTC681xChip of the monitor used on every bank
+template <typename Chip>
 class BMSThread {
 public:
 
-    BMSThread(LTC681xBus& bus, unsigned int frequency, BmsEventMailbox* bmsEventMailbox, MainToBMSMailbox* mainToBMSMailbox);
+    // chains: daisy chains carrying all traffic, each on its own SPI
+    // peripheral and holding the next banks in order. When empty, every chip
+    // is addressed individually over bus.
+    BMSThread(LTC681xBus& bus, unsigned int frequency, BmsEventMailbox* bmsEventMailbox, MainToBMSMailbox* mainToBMSMailbox, PackVoltageMailbox* packVoltageMailbox, std::vector<LTC6811ChainBus*> chains = {}, LTC6811ChainBus* addressedReader = nullptr);
 
     // Function to allow for starting threads from static context
     static void startThread(BMSThread *p) {
@@ -30,15 +52,393 @@ public:
     }
 
 private:
+    static constexpr unsigned int kCellCount = Chip::Variant::kCellCount;
+    static constexpr unsigned int kCellGroupCount = Chip::Variant::kCellGroupCount;
+
+    static_assert(Chip::Variant::kAddressable || BMS_ISOSPI_CHAIN,
+                  "LTC6812 and LTC6813 only work on a daisy chain");
+    static_assert(kPackTopology.fitsMonitor(kCellCount),
+                  "kPackTopology uses a cell pin the monitor doesn't have");
+
+    enum class RegisterGroup {
+        kConfigurationA,
+        kCellVoltageA,
+        kCellVoltageB,
+        kCellVoltageC,
+        kCellVoltageD,
+        // LTC6812 and LTC6813 only
+        kCellVoltageE,
+        // LTC6813 only
+        kCellVoltageF,
+        kAuxiliaryA,
+        kAuxiliaryB,
+        // LTC6812 and LTC6813 only
+        kAuxiliaryC,
+        kAuxiliaryD,
+        kStatusA,
+        kStatusB
+    };
+
+    // Cell voltage groups in order, the chip has the first kCellGroupCount
+    static constexpr RegisterGroup kCellVoltageGroups[6] = {
+        RegisterGroup::kCellVoltageA, RegisterGroup::kCellVoltageB,
+        RegisterGroup::kCellVoltageC, RegisterGroup::kCellVoltageD,
+        RegisterGroup::kCellVoltageE, RegisterGroup::kCellVoltageF};
+
+    // Connected cells in pack order, for walking the cells of the pack
+    static constexpr std::array<CellSlot, BMS_CELL_COUNT> kCellSlots =
+        makeCellSlots<BMS_CELL_COUNT>(kPackTopology);
+    // Connected cells by register group and then bank. kSlotStarts[i] to
+    // kSlotStarts[i + 1] are the cells read back from bank b in cell voltage
+    // group g, where i = g * BMS_BANK_COUNT + b.
+    static constexpr std::array<CellSlot, BMS_CELL_COUNT> kGroupedCellSlots =
+        makeGroupedCellSlots<BMS_CELL_COUNT>(kPackTopology);
+    static constexpr std::array<uint16_t, kCellGroupCount * BMS_BANK_COUNT + 1> kSlotStarts =
+        makeSlotStarts<kCellGroupCount>(kPackTopology);
+
+    // Cells and thermistors found out of range, waiting to be confirmed
+    struct Suspects {
+        // Cell pins of each bank, C1 in the LSB
+        uint32_t cellPins[BMS_BANK_COUNT] = {};
+        // Mux channels of each bank, channel 0 in the LSB
+        uint8_t thermistors[BMS_BANK_COUNT] = {};
+    };
+
+    // Conversions started on every chip at once
+    enum class Conversion {
+        kSelfTestCellVoltage,
+        kSelfTestGpio,
+        kCellVoltage,
+        kCellVoltageSum,
+        // GPIO4, the thermistor mux output
+        kThermistor,
+        kSumOfCells,
+        // ADOL, cell 7 on two ADCs at once
+        kOverlap,
+        // DIAGN, result in MUXFAIL of status group B
+        kDiagnoseMux,
+        // ADSTAT on the internal die temperature only
+        kDieTemperature
+    };
+
+    // Per-chip thermistor scan of one bank, stepped by m_executor alongside
+    // the other banks
+    class BankTemperatureScan : public ScanTask {
+    public:
+        BankTemperatureScan(BMSThread& bms, uint8_t bank, AdcMode mode);
+
+        std::optional<std::chrono::microseconds> step(std::chrono::microseconds now) override;
+
+    private:
+        // How often to poll once the conversion should be done
+        static constexpr std::chrono::microseconds kPollInterval{100};
+
+        enum class State {
+            // Set the mux and start converting GPIO4
+            kSelectChannel,
+            // Poll for the end of the conversion, then read it back
+            kConverting
+        };
+
+        BMSThread& m_bms;
+        uint8_t m_bank;
+        AdcMode m_mode;
+
+        State m_state = State::kSelectChannel;
+        uint8_t m_channel = 0;
+        std::chrono::microseconds m_deadline{0};
+    };
+
+    // Background open wire check, stepped by m_diagnostics
+    //
+    // Following the datasheet, the cell inputs are pulled up with ADOW for
+    // kPullConversions conversions and read back, then the same pulling down.
+    // A cell reading much higher pulled down than pulled up has its lower
+    // wire open. Each pull is one step to start it and one per conversion, so
+    // a step never holds the bus for more than a few register reads. Banks
+    // are checked one at a time, or all at once on a daisy chain where every
+    // chip gets the command anyway.
+    class OpenWireCheck : public DiagnosticTask {
+    public:
+        explicit OpenWireCheck(BMSThread& bms);
+
+        Kernel::Clock::time_point nextStep() const override { return m_nextStep; }
+        // Starting a pull needs room for all of its conversions
+        bool fitsBefore(Kernel::Clock::time_point deadline) const override;
+        void step() override;
+        bool busy() const override { return m_state == State::kConverting; }
+        // Start the current pull over
+        void interrupted() override;
+
+    private:
+        // The datasheet asks for at least two at 7kHz
+        static constexpr uint8_t kPullConversions = 2;
+        // CELL_PU - CELL_PD below this means an open wire
+        //
+        // Units: 100uV
+        static constexpr int32_t kOpenWireDelta = -4000;
+        // How often to poll once the conversion should be done
+        static constexpr std::chrono::microseconds kPollInterval{100};
+        // Allowance for reading back every cell voltage group
+        static constexpr std::chrono::microseconds kReadBackTime{1000};
+
+        enum class State {
+            // Waiting for a slot to start the next pull
+            kWaiting,
+            // Poll for the end of a conversion, then start the next one or
+            // read back
+            kConverting
+        };
+
+        BMSThread& m_bms;
+
+        State m_state = State::kWaiting;
+        bool m_pullUp = true;
+        uint8_t m_conversions = 0;
+        // Next bank to check, unused on a daisy chain
+        uint8_t m_bank = 0;
+        AdcMode m_mode;
+        Kernel::Clock::time_point m_nextStep;
+        Kernel::Clock::time_point m_nextCheck;
+        Kernel::Clock::time_point m_deadline;
+
+        // Raw cell readings of the check in progress, in 100uV
+        uint16_t m_pulledUp[BMS_BANK_COUNT][kCellCount];
+        uint16_t m_pulledDown[BMS_BANK_COUNT][kCellCount];
+        // Banks that could not be read back in this check
+        uint32_t m_failed = 0;
+
+        // Banks being checked, bank 0 in the LSB
+        uint32_t banks() const;
+        bool startPull();
+        void readBack();
+        // Compare the two pulls of every bank checked and update cellHealth
+        void evaluate();
+        // Conversion time of one pull conversion
+        std::chrono::microseconds pullConversionTime() const;
+        // Move on to the next check, whether or not this one got anywhere
+        void finishCheck();
+    };
+
+    // Background self tests, stepped by m_diagnostics
+    //
+    // The first round is due straight away, so the startup self test runs in
+    // the first free bus time after the first scan.
+    //
+    // Runs one test at a time on every chip at once and checks the result
+    // against the datasheet: the cell (CVST) and GPIO (AXST) self tests must
+    // read back the self test code on every channel, cell 7 converted on two
+    // ADCs (ADOL) must agree, and the mux diagnostic (DIAGN) must not set
+    // MUXFAIL. Results go to m_chipDiagnostics.
+    class SelfTestCheck : public DiagnosticTask {
+    public:
+        explicit SelfTestCheck(BMSThread& bms);
+
+        Kernel::Clock::time_point nextStep() const override { return m_nextStep; }
+        // Starting a test needs room for its conversion and read back
+        bool fitsBefore(Kernel::Clock::time_point deadline) const override;
+        void step() override;
+        bool busy() const override { return m_state == State::kConverting; }
+        // Start the current test over
+        void interrupted() override;
+
+    private:
+        // Largest difference between the two overlap readings
+        //
+        // Units: 100uV
+        static constexpr int32_t kOverlapTolerance = 200;
+        // How often to poll once the conversion should be done
+        static constexpr std::chrono::microseconds kPollInterval{100};
+        // Allowance for reading back every register group of a test
+        static constexpr std::chrono::microseconds kReadBackTime{1000};
+
+        enum class Test {
+            kCellSelfTest,
+            kGpioSelfTest,
+            kAdcOverlap,
+            kMux
+        };
+        static constexpr unsigned int kTestCount = 4;
+
+        enum class State {
+            // Waiting for a slot to start the next test
+            kWaiting,
+            // Poll for the end of the conversion, then read back
+            kConverting
+        };
+
+        BMSThread& m_bms;
+
+        State m_state = State::kWaiting;
+        Test m_test = Test::kCellSelfTest;
+        AdcMode m_mode;
+        Kernel::Clock::time_point m_nextStep;
+        Kernel::Clock::time_point m_nextTest;
+        Kernel::Clock::time_point m_deadline;
+
+        bool startTest();
+        // Read back and check the result of every chip
+        void readBack();
+        std::chrono::microseconds testTime() const;
+        // Move on to the next test, whether or not this one got anywhere
+        void finishTest();
+    };
+
     bool balanceAllowed = false;
     bool charging = false;
+    bool parked = false;
     LTC681xBus& m_bus;
-    std::vector<LTC6811> m_chips;
+    std::vector<LTC6811ChainBus*> m_chains;
+    // Single chip LTC6811ChainBus on the SPI of the parallel bus, reads the
+    // register groups of one chip at a time asynchronously. Without it the
+    // blocking reads of m_bus are used.
+    LTC6811ChainBus* m_addressedReader;
+    std::vector<Chip> m_chips;
+    ConfigManager<Chip> m_configs;
+    ScanExecutor m_executor;
+    OpenWireCheck m_openWire;
+    SelfTestCheck m_selfTest;
+    DiagnosticScheduler m_diagnostics;
     BmsEventMailbox* bmsEventMailbox;
     MainToBMSMailbox* mainToBMSMailbox;
+    PackVoltageMailbox* packVoltageMailbox;
+
+    // Measurements of the last scan, decoded into in place
+    PackSnapshot m_snapshot;
+
+    // Sum of all cell voltages from the last full scan, in mV
+    uint32_t m_lastCellSum = 0;
+    // Outcome of the last pack voltage check, to print only changes
+    bool m_packVoltagePlausible = true;
+    // Full scans in a row each bank has been stale, see checkStaleBanks()
+    uint8_t m_staleScans[BMS_BANK_COUNT] = {};
 
     BMSThreadState bmsState = BMSThreadState::BMSStartup;
 
+    // Group requested by the last startReadRegisterGroup()
+    RegisterGroup m_pendingRead = RegisterGroup::kConfigurationA;
+
+    // Register group retries left in the current scan
+    unsigned int m_retryBudget = BMS_READ_RETRY_BUDGET;
+    std::array<LinkHealth, BMS_BANK_COUNT> m_linkHealth;
+    std::array<ChipDiagnostics, BMS_BANK_COUNT> m_chipDiagnostics;
+    BootTimings m_bootTimings;
+    BalancePlanner m_balancePlanner;
+
+    // Time since the kernel started, for m_bootTimings
+    static std::chrono::milliseconds sinceBoot() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            Kernel::Clock::now().time_since_epoch());
+    }
+
     void throwBmsFault();
     void threadWorker();
+
+    void wakeupBus();
+    // Set ADCOPT on every chip for a conversion, flush before starting it
+    //
+    // returns: mode to start the conversion with
+    AdcMode applyAdcSettings(AdcPurpose purpose);
+    bool startConversion(Conversion conversion, AdcMode mode);
+    // Start converting the cells of one CH selection on every chip
+    //
+    // pair: 0 for cells 1, 7 (and 13), up to 5 for cells 6, 12 (and 18)
+    bool startCellPairConversion(uint8_t pair, AdcMode mode);
+    // Read one register group from every chip
+    //
+    // data: 6 bytes per chip, chip 0 first
+    bool readRegisterGroup(RegisterGroup group, uint8_t* data);
+    // decode: bool(unsigned int bank, const uint8_t* group), see
+    //         LTC6811ChainBus::FinishReadCommand(). Called once per chip that
+    //         reads back, straight from the receive buffer where possible.
+    template <typename F>
+    // chips: bit mask of the banks to read, the rest are skipped where the
+    //        bus allows it
+    bool readRegisterGroup(RegisterGroup group, F decode, uint32_t* failedChips = nullptr,
+                           uint32_t chips = LTC6811ChainBus::kAllChips);
+    // Split version of readRegisterGroup(). On daisy chains the transfer runs
+    // in the background between the two calls, nothing else may use the bus
+    // until it is finished.
+    //
+    // Chips whose read fails are retried on their own, within
+    // BMS_READ_RETRY_LIMIT and what is left of m_retryBudget. Their slots keep
+    // whatever was there before if that doesn't help.
+    //
+    // failedChips: set to a bit mask of the chips that could not be read
+    bool startReadRegisterGroup(RegisterGroup group);
+    bool finishReadRegisterGroup(uint8_t* data, uint32_t* failedChips = nullptr);
+    template <typename F>
+    bool finishReadRegisterGroup(F decode, uint32_t* failedChips = nullptr,
+                                 uint32_t chips = LTC6811ChainBus::kAllChips);
+    static const CommandFrame& chainReadFrame(RegisterGroup group);
+    LTC681xBus::LTC681xBusStatus readAddressedGroup(RegisterGroup group, uint8_t chip, uint8_t* rxbuf);
+    // Count a failure or retry on every chip in a mask, chip first in the LSB
+    void recordLinkErrors(unsigned int first, uint32_t chips, bool timeout);
+    void recordRetries(unsigned int first, uint32_t chips);
+    // Record the outcome of a self test on the chips that ran it
+    //
+    // test: ChipDiagnostics bit of the test, name: for printing
+    // tested, failed: chip masks, chip 0 in the LSB
+    void recordSelfTest(uint8_t test, const char* name, uint32_t tested, uint32_t failed);
+    // Check the PEC of cell voltage register group 0-5 (A-F) of one bank and
+    // decode its connected cells into m_snapshot
+    bool decodeVoltageGroup(uint8_t group, unsigned int bank, const uint8_t* rawGroup);
+    // Check the PEC of auxiliary group B of one bank and convert GPIO4 for one
+    // mux channel into m_snapshot
+    bool decodeTemperature(uint8_t channel, unsigned int bank, const uint8_t* rawAux);
+    // Convert and read back the die temperature of every chip into
+    // m_snapshot
+    void measureDieTemperatures();
+    // Fast path between full scans: convert only the sum of cells on every
+    // chip and publish the pack voltage
+    void samplePackVoltage();
+    // Fast path between full scans: run a fast cell conversion and read back
+    // the OV/UV comparator flags of every chip
+    //
+    // returns: true if any connected cell was flagged
+    //
+    // flagged: set to the flagged cells
+    bool pollVoltageFlags(Suspects& flagged);
+    // Run the fast paths until nextScan
+    //
+    // flagged: set to the flagged cells if the comparators flagged any
+    // returns: true if the OV/UV comparators flagged a cell, without waiting
+    //          for nextScan
+    bool waitForNextScan(Kernel::Clock::time_point nextScan, Suspects& flagged);
+    // Take the settings of a message from main, deleting it
+    //
+    // returns: true if it ended parked mode
+    bool applyMainEvent(MainToBMSEvent* event);
+    // Sleep until a point in time. While parked this waits on the main
+    // mailbox, so a wake condition doesn't have to sit out the parked period.
+    //
+    // returns: true if parked mode ended before until
+    bool sleepUntil(Kernel::Clock::time_point until);
+
+    bool voltageOutOfRange(uint16_t voltage) const;
+    bool temperatureOutOfRange(int8_t temperature) const;
+    // Everything in m_snapshot that is out of range
+    Suspects findSuspects() const;
+    // Convert and read back only the suspect cells and thermistors, instead of
+    // waiting on a full scan
+    //
+    // returns: true if any of them is still out of range
+    bool confirmFault(const Suspects& suspects);
+    // Enter BMSFaultRecover, then either throw the fault or go back to
+    // BMSIdle depending on confirmFault()
+    void recoverFault(const Suspects& suspects);
+    static void setMuxChannel(LTC6811::Configuration& config, uint8_t channel);
+    void scanTemperaturesBroadcast();
+    void scanTemperaturesPerChip();
+    // Count the scans in a row each bank has been stale, and fault once one
+    // reaches BMS_STALE_SCAN_LIMIT
+    void checkStaleBanks();
+
+    // Wait for a conversion started on every chip
+    bool waitForConversion(AdcConversion conversion, AdcMode mode);
+    // Poll once whether a conversion is done, for stepped jobs that can't
+    // block on waitForConversion()
+    //
+    // banks: chips to poll, all of them on a daisy chain
+    bool pollConversion(uint32_t banks);
 };
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "ConfigManager.h"
+
+#include <cstring>
+
+#include "LTC681xCommand.h"
+
+template <typename Chip>
+ConfigManager<Chip>::ConfigManager(LTC681xBus &bus, std::vector<Chip> &chips,
+                                   const std::vector<LTC6811ChainBus *> &chains)
+    : m_bus(bus), m_chips(chips), m_chains(chains) {
+  invalidate();
+}
+
+template <typename Chip>
+unsigned int ConfigManager<Chip>::flush() {
+  constexpr unsigned int size = Chip::kConfigSize;
+  uint8_t config[BMS_BANK_COUNT][size];
+  bool dirty[BMS_BANK_COUNT];
+  bool anyDirty = false;
+  bool identical = true;
+
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    m_chips[i].serializeConfig(config[i]);
+    dirty[i] = !m_valid[i] || memcmp(config[i], m_written[i], size) != 0;
+    anyDirty = anyDirty || dirty[i];
+    identical = identical && memcmp(config[i], config[0], size) == 0;
+  }
+
+  if (!anyDirty) {
+    return 0;
+  }
+
+  // Chips whose write went out, the others stay dirty for the next flush
+  bool sent[BMS_BANK_COUNT] = {};
+  unsigned int writes = 0;
+  if (!m_chains.empty()) {
+    // Every chip on a chain gets shifted a group anyway, so write whole chains
+    // and skip the ones where nothing changed
+    unsigned int first = 0;
+    for (LTC6811ChainBus *chain : m_chains) {
+      unsigned int count = chain->getChipCount();
+      bool chainDirty = false;
+      for (unsigned int i = first; i < first + count; i++) {
+        chainDirty = chainDirty || dirty[i];
+      }
+      if (chainDirty) {
+        // The chain takes one register group at a time, 6 bytes per chip
+        uint8_t group[BMS_BANK_COUNT][6];
+        for (unsigned int i = 0; i < count; i++) {
+          memcpy(group[i], config[first + i], 6);
+        }
+        bool ok = chain->SendDataCommand(LTC6811ChainBus::kWriteConfigurationGroupA, group[0]) ==
+                  LTC6811ChainBus::Status::Ok;
+        writes++;
+
+        if constexpr (Chip::Variant::kConfigGroupCount > 1) {
+          for (unsigned int i = 0; i < count; i++) {
+            memcpy(group[i], config[first + i] + 6, 6);
+          }
+          ok = chain->SendDataCommand(LTC6811ChainBus::kWriteConfigurationGroupB, group[0]) ==
+                   LTC6811ChainBus::Status::Ok && ok;
+          writes++;
+        }
+        for (unsigned int i = first; i < first + count; i++) {
+          sent[i] = ok;
+        }
+      }
+      first += count;
+    }
+  } else if constexpr (Chip::Variant::kAddressable) {
+    if (identical) {
+      // Same data for every chip, so a single broadcast write does
+      bool ok = m_bus.SendDataCommand(LTC681xBus::BuildBroadcastBusCommand(
+                    WriteConfigurationGroupA()), config[0]) == LTC681xBus::LTC681xBusStatus::Ok;
+      writes = 1;
+      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+        sent[i] = ok;
+      }
+    } else {
+      for (int i = 0; i < BMS_BANK_COUNT; i++) {
+        if (dirty[i]) {
+          sent[i] = m_chips[i].updateConfig() == LTC681xBus::LTC681xBusStatus::Ok;
+          writes++;
+        }
+      }
+    }
+  }
+
+  // verify() only expects what actually went out. Without a chain a chip
+  // that isn't addressable can't be written at all.
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (sent[i]) {
+      memcpy(m_written[i], config[i], size);
+      m_valid[i] = true;
+    }
+  }
+  return writes;
+}
+
+template <typename Chip>
+void ConfigManager<Chip>::invalidate() {
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    m_valid[i] = false;
+  }
+}
+
+template <typename Chip>
+void ConfigManager<Chip>::invalidate(uint32_t chips) {
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (chips & (1u << i)) {
+      m_valid[i] = false;
+    }
+  }
+}
+
+template <typename Chip>
+bool ConfigManager<Chip>::verify(const uint8_t *readback) {
+  bool ok = true;
+  for (int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (!m_valid[i]) {
+      continue;
+    }
+
+    const uint8_t *read = readback + i * 6;
+
+    // The GPIO bits read back the pin level and DTEN the state of the DTEN
+    // pin, so only REFON and ADCOPT of the first byte are comparable
+    bool match = ((read[0] ^ m_written[i][0]) & 0x05) == 0 &&
+                 memcmp(read + 1, m_written[i] + 1, 5) == 0;
+    if (!match) {
+      m_valid[i] = false;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+template class ConfigManager<LTC6811>;
+template class ConfigManager<LTC6812>;
+template class ConfigManager<LTC6813>;
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BmsConfig.h"
+#include "LTC6811.h"
+#include "LTC6811ChainBus.h"
+#include "LTC681xBus.h"
+
+// Shadow of the configuration register groups (CFGR) of every chip
+//
+// Changes are made through LTC6811::getConfig() as before, but nothing goes
+// on the bus until flush(). A chip is only written if its configuration
+// differs from what was last written to it, and when every chip needs the
+// same bytes they all get a single broadcast WRCFGA.
+template <typename Chip>
+class ConfigManager {
+public:
+    // chains: daisy chains holding the chips in order, or empty for addressed
+    // writes on bus
+    ConfigManager(LTC681xBus& bus, std::vector<Chip>& chips,
+                  const std::vector<LTC6811ChainBus*>& chains);
+
+    // Write every chip whose configuration changed since the last flush
+    //
+    // returns: number of WRCFGx transactions sent
+    unsigned int flush();
+
+    // Forget what was written, so the next flush writes every chip. Needed
+    // whenever the chips may have reset their configuration, e.g. after a
+    // watchdog timeout.
+    void invalidate();
+    // Same for some chips only, chip 0 in the LSB
+    void invalidate(uint32_t chips);
+
+    // Compare a CFGRA readback against what was last written
+    //
+    // readback: 6 bytes per chip, chip 0 first
+    // returns: false if any chip differs, those chips are also marked dirty
+    bool verify(const uint8_t* readback);
+
+private:
+    LTC681xBus& m_bus;
+    std::vector<Chip>& m_chips;
+    const std::vector<LTC6811ChainBus*>& m_chains;
+
+    uint8_t m_written[BMS_BANK_COUNT][Chip::kConfigSize];
+    bool m_valid[BMS_BANK_COUNT];
+};
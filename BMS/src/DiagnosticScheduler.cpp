@@ -0,0 +1,37 @@
+#include "DiagnosticScheduler.h"
+
+bool DiagnosticScheduler::add(DiagnosticTask *task) {
+  if (m_taskCount >= kMaxTasks) {
+    return false;
+  }
+  m_tasks[m_taskCount++] = task;
+  return true;
+}
+
+DiagnosticTask *DiagnosticScheduler::next(Kernel::Clock::time_point deadline) const {
+  for (unsigned int i = 0; i < m_taskCount; i++) {
+    DiagnosticTask *task = m_tasks[i];
+    if (task->busy()) {
+      return task->nextStep() < deadline ? task : nullptr;
+    }
+  }
+
+  // Earliest due first, ties go to the lowest index
+  DiagnosticTask *next = nullptr;
+  for (unsigned int i = 0; i < m_taskCount; i++) {
+    DiagnosticTask *task = m_tasks[i];
+    if (task->nextStep() >= deadline || !task->fitsBefore(deadline)) {
+      continue;
+    }
+    if (next == nullptr || task->nextStep() < next->nextStep()) {
+      next = task;
+    }
+  }
+  return next;
+}
+
+void DiagnosticScheduler::interrupted() {
+  for (unsigned int i = 0; i < m_taskCount; i++) {
+    m_tasks[i]->interrupted();
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "mbed.h"
+#include "rtos.h"
+
+// One background diagnostic, run a step at a time in bus time nothing else
+// needs
+//
+// Like ScanTask, each step does a little bus work and returns instead of
+// blocking. Unlike ScanTask, a diagnostic never finishes, it just moves on to
+// the next check whenever one is done.
+class DiagnosticTask {
+public:
+    virtual ~DiagnosticTask() = default;
+
+    // When the next step is due, may be in the past
+    virtual Kernel::Clock::time_point nextStep() const = 0;
+
+    // Whether the next step and the steps after it that must not be
+    // interrupted will all be done by deadline
+    virtual bool fitsBefore(Kernel::Clock::time_point deadline) const = 0;
+
+    virtual void step() = 0;
+
+    // Whether a conversion of the task is in progress, no other task may
+    // convert until it is read back
+    virtual bool busy() const = 0;
+
+    // Something else converted in the meantime, start over whatever was
+    // converting
+    virtual void interrupted() = 0;
+};
+
+// Picks which DiagnosticTask gets the bus between the fast paths of a scan
+//
+// A task is only picked if it fits before the next job that has a deadline,
+// so diagnostics never delay the scan, however many there are.
+class DiagnosticScheduler {
+public:
+    static constexpr unsigned int kMaxTasks = 4;
+
+    // returns: false if the task table is full
+    bool add(DiagnosticTask* task);
+
+    // Task to step before deadline, the one due earliest of those that fit.
+    // While a task is busy, no other one is picked.
+    //
+    // returns: nullptr if none is due before deadline or none fits
+    DiagnosticTask* next(Kernel::Clock::time_point deadline) const;
+
+    // Pass DiagnosticTask::interrupted() on to every task
+    void interrupted();
+
+private:
+    DiagnosticTask* m_tasks[kMaxTasks];
+    unsigned int m_taskCount = 0;
+};
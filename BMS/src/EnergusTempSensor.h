@@ -1,11 +1,47 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <optional>
+
+#include "ThermistorTable.h"
+
+// Curve of the Energus temp sensor
+struct EnergusCurve {
+    // Pairs of temp and corresponding voltage. Temp in celsius, voltage in mV
+    static constexpr std::array<ConversionPoint, 33> kPoints{
+            {{-40, 2440}, {-35, 2420}, {-30, 2400}, {-25, 2380}, {-20, 2350},
+             {-15, 2320}, {-10, 2270}, {-5, 2230},  {0, 2170},   {5, 2110},
+             {10, 2050},  {15, 1990},  {20, 1920},  {25, 1860},  {30, 1800},
+             {35, 1740},  {40, 1680},  {45, 1630},  {50, 1590},  {55, 1550},
+             {60, 1510},  {65, 1480},  {70, 1450},  {75, 1430},  {80, 1400},
+             {85, 1380},  {90, 1370},  {95, 1350},  {100, 1340}, {105, 1330},
+             {110, 1320}, {115, 1310}, {120, 1300}}};
+};
+
+using EnergusTempTable = ThermistorTable<EnergusCurve>;
 
 // Convert voltage reading from LTC6811 to temperature measurement for
 // Energus temp sensor
 //
 // voltage: voltage in mV
-// value: temp as unsigned byte
-int8_t convertTemp(uint16_t voltage);
\ No newline at end of file
+// value: temp in celsius, kTempBelowRange or kTempAboveRange off the curve
+constexpr int8_t convertTemp(uint16_t voltage) {
+    return EnergusTempTable::convert(voltage);
+}
+
+// Ends of the curve and the points between them
+static_assert(convertTemp(2440) == -40);
+static_assert(convertTemp(2170) == 0);
+static_assert(convertTemp(1860) == 25);
+static_assert(convertTemp(1300) == 120);
+// Between points, halves round towards the colder point
+static_assert(convertTemp(2430) == -38);
+static_assert(convertTemp(2200) == -3);
+static_assert(convertTemp(2150) == 2);
+static_assert(convertTemp(2140) == 2);
+static_assert(convertTemp(1890) == 22);
+// Off the curve, what temperatureOutOfRange() looks for
+static_assert(convertTemp(2441) == kTempBelowRange);
+static_assert(convertTemp(UINT16_MAX) == kTempBelowRange);
+static_assert(convertTemp(1299) == kTempAboveRange);
+static_assert(convertTemp(0) == kTempAboveRange);
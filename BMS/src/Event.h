@@ -3,6 +3,7 @@
 #include "BmsConfig.h"
 
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <optional>
 #include <stdint.h>
@@ -11,28 +12,104 @@
 #include "rtos.h"
 #include "Mail.h"
 
+#include "PackSnapshot.h"
+
+// isoSPI link errors of one chip since startup
+struct LinkHealth {
+    // Register groups that came back with a bad PEC
+    uint32_t pecErrors = 0;
+    // Transfers or conversions that never completed
+    uint32_t timeouts = 0;
+    // Register group reads repeated because of either of the above
+    uint32_t retries = 0;
+};
+
+// When each phase of startup was done, as time since the kernel started.
+// Zero until the phase is done.
+struct BootTimings {
+    // Bus woken up and every chip configured
+    std::chrono::milliseconds busReady{0};
+    // First full scan that read back the cells of every chip
+    std::chrono::milliseconds firstScan{0};
+    // Snapshot of that scan put in the mailbox, the time to first snapshot.
+    // Its BmsEvent is not validated yet, see selfTests.
+    std::chrono::milliseconds firstSnapshot{0};
+    // Every self test run once on every chip, from here on BmsEvent::validated
+    // can be set
+    std::chrono::milliseconds selfTests{0};
+};
+
+// Background self test results of one chip
+struct ChipDiagnostics {
+    // Bits of tested and failed
+    static constexpr uint8_t kCellSelfTest = 1 << 0;
+    static constexpr uint8_t kGpioSelfTest = 1 << 1;
+    static constexpr uint8_t kAdcOverlap = 1 << 2;
+    static constexpr uint8_t kMux = 1 << 3;
+
+    // Tests that have run on the chip at least once
+    uint8_t tested = 0;
+    // Tests that failed the last time they ran
+    uint8_t failed = 0;
+    // Failed tests since startup
+    uint32_t failures = 0;
+};
+
 class BmsEvent {
 public:
-    uint16_t voltageValues[BMS_BANK_COUNT * BMS_BANK_CELL_COUNT];
-    int8_t temperatureValues[BMS_BANK_COUNT * BMS_BANK_TEMP_COUNT];
+    PackSnapshot snapshot;
     uint8_t minVolt;
     uint8_t maxVolt;
     int8_t minTemp;
     int8_t maxTemp;
     int8_t avgTemp;
+    // Where the extremes are, index in pack order into snapshot.cellVoltages
+    // and snapshot.cellTemperatures
+    uint16_t minVoltCell;
+    uint16_t maxVoltCell;
+    uint16_t minTempThermistor;
+    uint16_t maxTempThermistor;
+    // Thermistors reading off their curve (kTempBelowRange or kTempAboveRange
+    // in the snapshot), which are left out of minTemp, maxTemp and avgTemp
+    uint16_t thermistorFaults;
+    // Sum of all cells, in mV
+    uint32_t packVoltage;
     bool isBalancing;
+    // Every self test has run on every chip and none of them is failing.
+    // Until then the measurements are not to be acted on.
+    bool validated;
     BMSThreadState bmsState;
+    LinkHealth linkHealth[BMS_BANK_COUNT];
+    ChipDiagnostics diagnostics[BMS_BANK_COUNT];
+    BootTimings boot;
 };
 
 class MainToBMSEvent {
 public:
     bool balanceAllowed = false;
     bool charging = false;
+    // Car is parked and not charging, the BMS drops to BMS_PARKED_SCAN_PERIOD
+    // until this is cleared again
+    bool parked = false;
+};
+
+class PackVoltageEvent {
+public:
+    // Sum of all cells from the status registers, in mV
+    uint32_t packVoltage;
+    // When the conversion finished
+    Kernel::Clock::time_point timestamp;
+    // Whether packVoltage agrees with the cell sum of the last full scan
+    bool plausible;
 };
 
 static constexpr auto mailboxSize = 4;
-using BmsEventMailbox = Queue<BmsEvent, mailboxSize>;
+// Events from the BMS thread come out of the fixed pool of a Mail, so a scan
+// never goes to the heap. try_alloc() returns nullptr while main still holds
+// every slot, and main hands each one back with free().
+using BmsEventMailbox = Mail<BmsEvent, mailboxSize>;
 using MainToBMSMailbox = Queue<MainToBMSEvent, mailboxSize>;
+using PackVoltageMailbox = Mail<PackVoltageEvent, mailboxSize>;
 
 // Measurement
 //  - Temp
@@ -4,8 +4,11 @@
 #include "rtos.h"
 
 #include "LTC681xParallelBus.h"
+#include "AdcConversion.h"
+#include "Pec15.h"
 
-LTC6811::LTC6811(LTC681xBus &bus, uint8_t id) : m_bus(bus), m_id(id) {
+template <typename V>
+LTC681xChip<V>::LTC681xChip(LTC681xBus &bus, uint8_t id) : m_bus(bus), m_id(id) {
   m_config =
     Configuration{.gpio5 = GPIOOutputState::kPassive,
                   .gpio4 = GPIOOutputState::kPassive,
@@ -18,12 +21,28 @@ LTC6811::LTC6811(LTC681xBus &bus, uint8_t id) : m_bus(bus), m_id(id) {
                   .undervoltageComparison = 0,
                   .overvoltageComparison = 0,
                   .dischargeState = {.value = 0},
-                  .dischargeTimeout = DischargeTimeoutValue::kDisabled};
+                  .dischargeTimeout = DischargeTimeoutValue::kDisabled,
+                  .gpio9 = GPIOOutputState::kPassive,
+                  .gpio8 = GPIOOutputState::kPassive,
+                  .gpio7 = GPIOOutputState::kPassive,
+                  .gpio6 = GPIOOutputState::kPassive};
 }
 
-void LTC6811::updateConfig() {
+template <typename V>
+LTC681xBus::LTC681xBusStatus LTC681xChip<V>::updateConfig() {
+  static_assert(Variant::kAddressable, "Only the LTC6811-2 can be written on its own");
+
   // Create configuration data to write
   uint8_t config[6];
+  serializeConfig(config);
+
+  auto cmd = LTC681xBus::BuildAddressedBusCommand(WriteConfigurationGroupA(), m_id);
+
+  return m_bus.SendDataCommand(cmd, config);
+}
+
+template <typename V>
+void LTC681xChip<V>::serializeConfig(uint8_t *config) const {
   config[0] = (uint8_t) m_config.gpio5 << 7
     | (uint8_t) m_config.gpio4 << 6
     | (uint8_t) m_config.gpio3 << 5
@@ -40,19 +59,60 @@ void LTC6811::updateConfig() {
   config[5] = (((uint8_t)m_config.dischargeTimeout & 0x0F) << 4)
     | ((m_config.dischargeState.value >> 8) & 0x0F);
 
-  auto cmd = LTC681xBus::BuildAddressedBusCommand(WriteConfigurationGroupA(), m_id);
+  if constexpr (Variant::kConfigGroupCount > 1) {
+    // Cells the variant doesn't have stay off
+    uint32_t discharge = m_config.dischargeState.value & ((1u << Variant::kCellCount) - 1);
+
+    config[6] = ((discharge >> 12) & 0x0F) << 4
+      | (uint8_t) m_config.gpio9 << 3
+      | (uint8_t) m_config.gpio8 << 2
+      | (uint8_t) m_config.gpio7 << 1
+      | (uint8_t) m_config.gpio6;
+    // DTMEN, path select and FDRF left at their defaults
+    config[7] = (discharge >> 16) & 0x03;
+    config[8] = 0;
+    config[9] = 0;
+    config[10] = 0;
+    config[11] = 0;
+  }
+}
 
-  m_bus.SendDataCommand(cmd, config);
+template <typename V>
+LTC681xRegisters::Configuration &LTC681xChip<V>::getConfig() { return m_config; }
+
+template <typename V>
+bool LTC681xChip<V>::pollAdcCompletion() {
+  return m_bus.PollAdcCompletion(LTC681xBus::BuildAddressedBusCommand(PollADCStatus(), m_id))
+    == LTC681xBus::LTC681xBusStatus::Ok;
 }
 
-LTC6811::Configuration &LTC6811::getConfig() { return m_config; }
+template <typename V>
+bool LTC681xChip<V>::decodeGroups(const uint8_t *rxbuf, unsigned int groups, uint16_t *values,
+                                  unsigned int count) {
+  bool ok = true;
+  for (unsigned int g = 0; g < groups; g++) {
+    const uint8_t *group = rxbuf + g * 8;
+    if (!checkPec15(group, 6)) {
+      printf("Things are not okay. PEC %d\n", m_id);
+      ok = false;
+      continue;
+    }
+    for (unsigned int i = 0; i < 3 && g * 3 + i < count; i++) {
+      values[g * 3 + i] = ((uint16_t)group[i * 2]) | ((uint16_t)group[i * 2 + 1] << 8);
+    }
+  }
+  return ok;
+}
+
+template <typename V>
+bool LTC681xChip<V>::getVoltages(mbed::Span<uint16_t, V::kCellCount> voltages) {
+  static_assert(Variant::kCellGroupCount == 4, "Only cell voltage groups A to D are read");
 
-uint16_t *LTC6811::getVoltages() {
   auto cmd = StartCellVoltageADC(AdcMode::k7k, false, CellSelection::kAll);
   m_bus.SendCommand(LTC681xBus::BuildAddressedBusCommand(cmd, m_id));
 
-  // Wait 2 ms for ADC to finish
-  ThisThread::sleep_for(2ms); // TODO: Change
+  waitForConversion(conversionTime(AdcConversion::kCellVoltage, AdcMode::k7k, m_config.adcMode),
+                    [this] { return pollAdcCompletion(); });
 
   // 4  * (Register of 6 Bytes + PEC)
   uint8_t rxbuf[8 * 4];
@@ -63,73 +123,44 @@ uint16_t *LTC6811::getVoltages() {
   m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadCellVoltageGroupD(), m_id), rxbuf + 24);
 
   // Voltage = val • 100μV
-  uint16_t *voltages = new uint16_t[12];
-  for (unsigned int i = 0; i < sizeof(rxbuf); i++) {
-    // Skip over PEC
-    if (i % 8 == 6 || i % 8 == 7) continue;
-
-    // Skip over odd bytes
-    if (i % 2 == 1) continue;
-
-    // Wack shit to skip over PEC
-    voltages[(i / 2) - (i / 8)] = ((uint16_t)rxbuf[i]) | ((uint16_t)rxbuf[i + 1] << 8);
-  }
-
-  return voltages;
+  return decodeGroups(rxbuf, 4, voltages.data(), voltages.size());
 }
 
-uint16_t *LTC6811::getGpio() {
-  auto cmd = StartGpioADC(AdcMode::k7k, GpioSelection::kAll);
-  m_bus.SendCommand(LTC681xBus::BuildAddressedBusCommand(cmd, m_id));
-
-  // Wait 15 ms for ADC to finish
-  ThisThread::sleep_for(5ms); // TODO: This could be done differently
-
-  uint8_t rxbuf[8 * 2];
-
-  m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupA(), m_id), rxbuf);
-  m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupB(), m_id), rxbuf + 8);
-
-  uint16_t *voltages = new uint16_t[5];
-
-  for (unsigned int i = 0; i < sizeof(rxbuf); i++) {
-    // Skip over PEC
-    if (i % 8 == 6 || i % 8 == 7) continue;
-
-    // Skip over odd bytes
-    if (i % 2 == 1) continue;
-
-    // Wack shit to skip over PEC
-    voltages[(i / 2) - (i / 8)] = ((uint16_t)rxbuf[i]) | ((uint16_t)rxbuf[i + 1] << 8);
-  }
-
-  return voltages;
+template <typename V>
+bool LTC681xChip<V>::getGpio(mbed::Span<uint16_t, V::kGpioCount> voltages) {
+  return getGpioPin(GpioSelection::kAll, voltages);
 }
 
-uint16_t *LTC6811::getGpioPin(GpioSelection pin) {
+template <typename V>
+bool LTC681xChip<V>::getGpioPin(GpioSelection pin, mbed::Span<uint16_t, V::kGpioCount> voltages) {
+  // Groups C and D of the LTC6812 and LTC6813 have no addressed read, and
+  // their reference sits between GPIO5 and GPIO6
+  static_assert(Variant::kAuxGroupCount == 2 && Variant::kGpioCount == 5,
+                "Only auxiliary groups A and B are read");
+
   auto cmd = StartGpioADC(AdcMode::k7k, pin);
   m_bus.SendCommand(LTC681xBus::BuildAddressedBusCommand(cmd, m_id));
 
-  // Wait 5 ms for ADC to finish
-  ThisThread::sleep_for(pin == GpioSelection::kAll ? 15ms : 5ms); // TODO: Change to polling
+  auto conversion = pin == GpioSelection::kAll ? AdcConversion::kGpioAll : AdcConversion::kGpioSingle;
+  waitForConversion(conversionTime(conversion, AdcMode::k7k, m_config.adcMode),
+                    [this] { return pollAdcCompletion(); });
 
   uint8_t rxbuf[8 * 2];
 
   m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupA(), m_id), rxbuf);
   m_bus.SendReadCommand(LTC681xBus::BuildAddressedBusCommand(ReadAuxiliaryGroupB(), m_id), rxbuf + 8);
 
-  uint16_t *voltages = new uint16_t[5];
-
-  for (unsigned int i = 0; i < sizeof(rxbuf); i++) {
-    // Skip over PEC
-    if (i % 8 == 6 || i % 8 == 7) continue;
-
-    // Skip over odd bytes
-    if (i % 2 == 1) continue;
+  // The second reference after GPIO5 is left out
+  return decodeGroups(rxbuf, 2, voltages.data(), voltages.size());
+}
 
-    // Wack shit to skip over PEC
-    voltages[(i / 2) - (i / 8)] = ((uint16_t)rxbuf[i]) | ((uint16_t)rxbuf[i + 1] << 8);
-  }
+template class LTC681xChip<LTC6811Variant>;
 
-  return voltages;
-}
\ No newline at end of file
+// The LTC6812 and LTC6813 are only used on a daisy chain, which is written
+// and read through LTC6811ChainBus rather than chip by chip
+template LTC681xChip<LTC6812Variant>::LTC681xChip(LTC681xBus &bus, uint8_t id);
+template LTC681xRegisters::Configuration &LTC681xChip<LTC6812Variant>::getConfig();
+template void LTC681xChip<LTC6812Variant>::serializeConfig(uint8_t *config) const;
+template LTC681xChip<LTC6813Variant>::LTC681xChip(LTC681xBus &bus, uint8_t id);
+template LTC681xRegisters::Configuration &LTC681xChip<LTC6813Variant>::getConfig();
+template void LTC681xChip<LTC6813Variant>::serializeConfig(uint8_t *config) const;
@@ -2,7 +2,52 @@
 
 #include <LTC681xParallelBus.h>
 
-class LTC6811 {
+#include "mbed.h"
+
+// Differences between the monitors of the LTC681x family
+//
+// The LTC6812 and LTC6813 only come as daisy chain (-1) parts, so only the
+// LTC6811 can be used on an LTC681xParallelBus.
+struct LTC6811Variant {
+    static constexpr unsigned int kCellCount = 12;
+    static constexpr unsigned int kGpioCount = 5;
+    // Register groups of 3 cells (CVA-CVD) and of GPIO results (AUXA-AUXB)
+    static constexpr unsigned int kCellGroupCount = 4;
+    static constexpr unsigned int kAuxGroupCount = 2;
+    // CFGRA only
+    static constexpr unsigned int kConfigGroupCount = 1;
+    // Channels each of the three ADCs converts for ADCV and ADAX, for scaling
+    // conversion times
+    static constexpr unsigned int kCellsPerAdc = 4;
+    static constexpr unsigned int kAuxChannels = 6;
+    static constexpr bool kAddressable = true;
+};
+
+struct LTC6812Variant {
+    static constexpr unsigned int kCellCount = 15;
+    static constexpr unsigned int kGpioCount = 9;
+    static constexpr unsigned int kCellGroupCount = 5;
+    static constexpr unsigned int kAuxGroupCount = 4;
+    // CFGRA and CFGRB
+    static constexpr unsigned int kConfigGroupCount = 2;
+    static constexpr unsigned int kCellsPerAdc = 5;
+    static constexpr unsigned int kAuxChannels = 10;
+    static constexpr bool kAddressable = false;
+};
+
+struct LTC6813Variant {
+    static constexpr unsigned int kCellCount = 18;
+    static constexpr unsigned int kGpioCount = 9;
+    static constexpr unsigned int kCellGroupCount = 6;
+    static constexpr unsigned int kAuxGroupCount = 4;
+    static constexpr unsigned int kConfigGroupCount = 2;
+    static constexpr unsigned int kCellsPerAdc = 6;
+    static constexpr unsigned int kAuxChannels = 10;
+    static constexpr bool kAddressable = false;
+};
+
+// Register definitions shared by every variant
+class LTC681xRegisters {
 public:
     enum class GPIOOutputState : uint8_t {
         // States with pull up resistor
@@ -24,7 +69,8 @@ public:
                 cell7 : 1, cell6 : 1, cell5 : 1, cell4 : 1, cell3 : 1, cell2 : 1,
                 cell1 : 1;
         };
-        uint16_t value;
+        // One bit per cell, cell 1 in the LSB. Cells 13-18 go to CFGRB.
+        uint32_t value;
     };
     // Discharge Timeout in minutes
     enum class DischargeTimeoutValue : uint8_t {
@@ -46,6 +92,15 @@ public:
         k120
       };
 
+    // Comparison values for a cell voltage threshold in mV, rounded so the
+    // comparator trips no later than the threshold itself
+    static constexpr uint16_t undervoltageThreshold(uint32_t millivolts) {
+        return (millivolts * 10 + 15) / 16 - 1;
+    }
+    static constexpr uint16_t overvoltageThreshold(uint32_t millivolts) {
+        return millivolts * 10 / 16;
+    }
+
     class Configuration {
     public:
         GPIOOutputState gpio5;
@@ -58,21 +113,57 @@ public:
         AdcModeOption adcMode;
         // Voltage = (val + 1) • 16 • 100μV
         uint16_t undervoltageComparison : 12;
+        // Voltage = val • 16 • 100μV
         uint16_t overvoltageComparison : 12;
         DischargeState dischargeState;
         DischargeTimeoutValue dischargeTimeout;
+        // CFGRB, LTC6812 and LTC6813 only
+        GPIOOutputState gpio9;
+        GPIOOutputState gpio8;
+        GPIOOutputState gpio7;
+        GPIOOutputState gpio6;
     };
+};
 
-    LTC6811(LTC681xBus &bus, uint8_t id);
+template <typename V>
+class LTC681xChip : public LTC681xRegisters {
+public:
+    using Variant = V;
+
+    // Bytes of configuration, 6 per register group
+    static constexpr unsigned int kConfigSize = 6 * Variant::kConfigGroupCount;
+
+    LTC681xChip(LTC681xBus &bus, uint8_t id);
     Configuration &getConfig();
-    void updateConfig();
+    // Write CFGRA to this chip alone
+    LTC681xBus::LTC681xBusStatus updateConfig();
+    // Pack the configuration into the CFGRA register layout, followed by
+    // CFGRB on variants that have it
+    //
+    // config: kConfigSize bytes
+    void serializeConfig(uint8_t *config) const;
 
-    uint16_t *getVoltages();
-    uint16_t *getGpio();
-    uint16_t *getGpioPin(GpioSelection pin);
+    // Convert and read back into the caller's array, returning false if any
+    // register group fails its PEC check. Values from those groups are left
+    // untouched. Addressed reads, so LTC6811 only.
+    //
+    // Units: 100uV
+    bool getVoltages(mbed::Span<uint16_t, Variant::kCellCount> voltages);
+    bool getGpio(mbed::Span<uint16_t, Variant::kGpioCount> voltages);
+    bool getGpioPin(GpioSelection pin, mbed::Span<uint16_t, Variant::kGpioCount> voltages);
 
 private:
+    bool pollAdcCompletion();
+    // Check the PEC of groups register groups of 8 bytes each and decode the
+    // three little endian values of every good one, up to count values
+    bool decodeGroups(const uint8_t *rxbuf, unsigned int groups, uint16_t *values,
+                      unsigned int count);
+
     LTC681xBus &m_bus;
     uint8_t m_id;
     Configuration m_config;
-};
\ No newline at end of file
+};
+
+using LTC6811 = LTC681xChip<LTC6811Variant>;
+using LTC6812 = LTC681xChip<LTC6812Variant>;
+using LTC6813 = LTC681xChip<LTC6813Variant>;
@@ -0,0 +1,144 @@
+#include "LTC6811ChainBus.h"
+
+#include <cstring>
+
+#include "mbed.h"
+
+LTC6811ChainBus::LTC6811ChainBus(SPI* spiDriver, unsigned int chipCount)
+    : m_spi(spiDriver), m_chipCount(chipCount),
+      m_txBuffer(4 + (kGroupSize + 2) * chipCount),
+      m_rxBuffer(4 + (kGroupSize + 2) * chipCount)
+#if DEVICE_SPI_ASYNCH
+      , m_transferDone(0, 1)
+#endif
+{
+#if DEVICE_SPI_ASYNCH
+  m_spi->set_dma_usage(DMA_USAGE_OPPORTUNISTIC);
+#endif
+}
+
+void LTC6811ChainBus::WakeupBus() {
+  // Each chip only wakes its upstream port once it is awake itself, so toggle
+  // chip select once per chip on the chain
+  const char dummy = 0xFF;
+  for (unsigned int i = 0; i < m_chipCount; i++) {
+    m_spi->write(&dummy, 1, nullptr, 0);
+    wait_us(400);
+  }
+}
+
+LTC6811ChainBus::Status LTC6811ChainBus::SendCommand(const CommandFrame &command) {
+  loadCommand(command);
+  m_spi->write((const char *)m_txBuffer.data(), 4, nullptr, 0);
+  return Status::Ok;
+}
+
+LTC6811ChainBus::Status LTC6811ChainBus::SendDataCommand(const CommandFrame &command,
+                                                         const uint8_t *data) {
+  loadCommand(command);
+
+  // The first group shifted in ends up on the chip furthest down the chain
+  uint8_t *out = m_txBuffer.data() + 4;
+  for (unsigned int i = m_chipCount; i-- > 0;) {
+    const uint8_t *group = data + i * kGroupSize;
+    uint16_t pec = calculatePec15(group, kGroupSize);
+
+    memcpy(out, group, kGroupSize);
+    out[kGroupSize] = pec >> 8;
+    out[kGroupSize + 1] = pec & 0xFF;
+    out += kGroupSize + 2;
+  }
+
+  m_spi->write((const char *)m_txBuffer.data(), m_txBuffer.size(), nullptr, 0);
+  return Status::Ok;
+}
+
+LTC6811ChainBus::Status LTC6811ChainBus::SendReadCommand(const CommandFrame &command,
+                                                         uint8_t *data) {
+  Status status = StartReadCommand(command);
+  if (status != Status::Ok) {
+    return status;
+  }
+  return FinishReadCommand(data);
+}
+
+LTC6811ChainBus::Status LTC6811ChainBus::StartReadCommand(const CommandFrame &command) {
+  // A read that was never finished still owns the receive buffer, wait it
+  // out (or abort it) first
+  m_startFailed = false;
+  waitForTransfer(kAllChips);
+  loadCommand(command);
+
+  // Bytes received while the command shifts out are meaningless, the groups
+  // follow directly after in chain order
+#if DEVICE_SPI_ASYNCH
+  if (m_spi->transfer(m_txBuffer.data(), 4, m_rxBuffer.data(),
+                      (int)m_rxBuffer.size(),
+                      callback(this, &LTC6811ChainBus::onTransferDone),
+                      SPI_EVENT_COMPLETE) == 0) {
+    m_transferPending = true;
+    return Status::Ok;
+  }
+  // Another transfer holds the peripheral. Waiting on it here would block
+  // for however long that takes, so leave it to the caller to retry.
+  m_startFailed = true;
+  return Status::Busy;
+#else
+  m_spi->write((const char *)m_txBuffer.data(), 4,
+               (char *)m_rxBuffer.data(), m_rxBuffer.size());
+  return Status::Ok;
+#endif
+}
+
+LTC6811ChainBus::Status LTC6811ChainBus::FinishReadCommand(uint8_t *data,
+                                                           uint32_t chips) {
+  return FinishReadCommand(
+      [data](unsigned int chip, const uint8_t *group) {
+        if (!checkPec15(group, kGroupSize)) {
+          return false;
+        }
+        memcpy(data + chip * kGroupSize, group, kGroupSize);
+        return true;
+      },
+      chips);
+}
+
+LTC6811ChainBus::Status LTC6811ChainBus::waitForTransfer(uint32_t chips) {
+  if (m_startFailed) {
+    m_startFailed = false;
+    m_failedChips = chips;
+    return Status::Busy;
+  }
+#if DEVICE_SPI_ASYNCH
+  if (m_transferPending) {
+    m_transferPending = false;
+    if (!m_transferDone.try_acquire_for(kTransferTimeout)) {
+      // Stop it so a late completion can't be mistaken for the next transfer
+      m_spi->abort_transfer();
+      m_failedChips = chips;
+      return Status::Timeout;
+    }
+  }
+#endif
+  return Status::Ok;
+}
+
+bool LTC6811ChainBus::PollAdcCompletion() {
+  loadCommand(kPollAdcStatus);
+
+  // SDO is held low until the last chip on the chain is done, so a non-zero
+  // byte after the command means the conversion is complete
+  m_spi->write((const char *)m_txBuffer.data(), 4,
+               (char *)m_rxBuffer.data(), 5);
+  return m_rxBuffer[4] != 0;
+}
+
+#if DEVICE_SPI_ASYNCH
+void LTC6811ChainBus::onTransferDone(int event) {
+  m_transferDone.release();
+}
+#endif
+
+void LTC6811ChainBus::loadCommand(const CommandFrame &command) {
+  memcpy(m_txBuffer.data(), command.data(), command.size());
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "mbed.h"
+
+#include "LTC681xCommand.h"
+#include "Pec15.h"
+
+// isoSPI bus for LTC6811-1, LTC6812-1 or LTC6813-1 monitors wired as a daisy
+// chain
+//
+// Chips on a chain are not addressed like the LTC6811-2 on an
+// LTC681xParallelBus. Every chip executes every command, a write shifts one
+// register group per chip down the chain, and a read clocks out the register
+// group of every chip in a single transaction.
+//
+// Register group data is always passed as one slot of kGroupSize bytes per
+// chip, with chip 0 (closest to the master) first.
+//
+// On targets with asynchronous SPI, reads can be split into
+// StartReadCommand() and FinishReadCommand(). The transfer then runs on DMA
+// and the calling thread is free until it collects the result.
+//
+// A chain of one chip reads a single LTC6811-2 of a parallel bus the same
+// way, given frames from makeAddressedCommandFrame(). That gets the parallel
+// bus asynchronous reads too.
+class LTC6811ChainBus {
+public:
+    // Busy: the SPI peripheral was still busy with another transfer, nothing
+    //       was sent
+    enum class Status { Ok, PecError, Timeout, Busy };
+
+    // Bytes in one register group, not counting the PEC
+    static constexpr unsigned int kGroupSize = 6;
+
+    // Chip masks hold one bit per chip, chip 0 in the LSB
+    static constexpr unsigned int kMaxChips = 32;
+    static constexpr uint32_t kAllChips = 0xFFFFFFFF;
+
+    // Frames for the fixed commands from the LTC6811 datasheet command table
+    static constexpr CommandFrame kWriteConfigurationGroupA = makeCommandFrame(0x001);
+    static constexpr CommandFrame kReadConfigurationGroupA = makeCommandFrame(0x002);
+    static constexpr CommandFrame kReadCellVoltageGroupA = makeCommandFrame(0x004);
+    static constexpr CommandFrame kReadCellVoltageGroupB = makeCommandFrame(0x006);
+    static constexpr CommandFrame kReadCellVoltageGroupC = makeCommandFrame(0x008);
+    static constexpr CommandFrame kReadCellVoltageGroupD = makeCommandFrame(0x00A);
+    static constexpr CommandFrame kReadAuxiliaryGroupA = makeCommandFrame(0x00C);
+    static constexpr CommandFrame kReadAuxiliaryGroupB = makeCommandFrame(0x00E);
+    // LTC6812 and LTC6813 only
+    static constexpr CommandFrame kWriteConfigurationGroupB = makeCommandFrame(0x024);
+    static constexpr CommandFrame kReadConfigurationGroupB = makeCommandFrame(0x026);
+    static constexpr CommandFrame kReadCellVoltageGroupE = makeCommandFrame(0x009);
+    static constexpr CommandFrame kReadCellVoltageGroupF = makeCommandFrame(0x00B);
+    static constexpr CommandFrame kReadAuxiliaryGroupC = makeCommandFrame(0x00D);
+    static constexpr CommandFrame kReadAuxiliaryGroupD = makeCommandFrame(0x00F);
+    static constexpr CommandFrame kReadStatusGroupA = makeCommandFrame(0x010);
+    static constexpr CommandFrame kReadStatusGroupB = makeCommandFrame(0x012);
+    static constexpr CommandFrame kPollAdcStatus = makeCommandFrame(0x714);
+    static constexpr CommandFrame kDiagnoseMux = makeCommandFrame(0x715);
+
+    // Conversion command words, built like their LTC681xCommand counterparts.
+    // Pass them through makeCommandFrame() in a constant expression to get the
+    // frame.
+    static constexpr uint16_t StartCellVoltageADC(AdcMode mode, bool dischargePermitted,
+                                                  CellSelection cells) {
+        return 0x260 | modeBits(mode) | (dischargePermitted << 4) | (uint8_t)cells;
+    }
+    static constexpr uint16_t StartCombinedCellVoltageSumADC(AdcMode mode,
+                                                             bool dischargePermitted) {
+        return 0x467 | modeBits(mode) | (dischargePermitted << 4);
+    }
+    static constexpr uint16_t StartOpenWireConversion(AdcMode mode, bool pullUp,
+                                                      bool dischargePermitted,
+                                                      CellSelection cells) {
+        return 0x228 | modeBits(mode) | (pullUp << 6) | (dischargePermitted << 4) | (uint8_t)cells;
+    }
+    static constexpr uint16_t StartOverlapMeasurement(AdcMode mode, bool dischargePermitted) {
+        return 0x201 | modeBits(mode) | (dischargePermitted << 4);
+    }
+    static constexpr uint16_t StartGpioADC(AdcMode mode, GpioSelection gpio) {
+        return 0x460 | modeBits(mode) | (uint8_t)gpio;
+    }
+    static constexpr uint16_t StartStatusADC(AdcMode mode, StatusGroupSelection status) {
+        return 0x468 | modeBits(mode) | (uint8_t)status;
+    }
+    static constexpr uint16_t StartSelfTestCellVoltage(AdcMode mode, SelfTestMode test) {
+        return 0x207 | modeBits(mode) | ((uint8_t)test << 5);
+    }
+    static constexpr uint16_t StartSelfTestGpio(AdcMode mode, SelfTestMode test) {
+        return 0x407 | modeBits(mode) | ((uint8_t)test << 5);
+    }
+
+    LTC6811ChainBus(SPI* spiDriver, unsigned int chipCount);
+
+    void WakeupBus();
+
+    // Send a command with no data to every chip
+    Status SendCommand(const CommandFrame& command);
+
+    // Write one register group to every chip
+    //
+    // data: kGroupSize bytes per chip, chip 0 first
+    Status SendDataCommand(const CommandFrame& command, const uint8_t* data);
+
+    // Read one register group from every chip in a single transaction
+    //
+    // data: kGroupSize bytes per chip, chip 0 first
+    // Slots of chips whose PEC did not match are left untouched
+    Status SendReadCommand(const CommandFrame& command, uint8_t* data);
+
+    // Start reading one register group from every chip without waiting for
+    // the transfer. Must be followed by FinishReadCommand() before anything
+    // else is sent on the chain.
+    //
+    // returns: Busy if the peripheral is in use, FinishReadCommand() then
+    //          fails every chip with Busy as well
+    Status StartReadCommand(const CommandFrame& command);
+
+    // Block until the read started by StartReadCommand() has completed
+    //
+    // data: kGroupSize bytes per chip, chip 0 first
+    // chips: bit mask of the chips whose slots should be filled, the others
+    //        are left untouched. Used to retry only the chips that failed.
+    // Slots of chips whose PEC did not match are left untouched
+    Status FinishReadCommand(uint8_t* data, uint32_t chips = kAllChips);
+
+    // Same, but without copying: each chip's register group is handed to
+    // decode straight from the receive buffer
+    //
+    // decode: bool(unsigned int chip, const uint8_t* group), called once for
+    //         every chip in chips. group holds kGroupSize bytes followed by
+    //         the PEC. Returns false if the PEC does not match.
+    template <typename F>
+    Status FinishReadCommand(F decode, uint32_t chips = kAllChips);
+
+    // Bit mask of the chips the last FinishReadCommand() failed to fill
+    uint32_t getFailedChips() const { return m_failedChips; }
+
+    // Poll once with PLADC
+    //
+    // returns: true if every chip on the chain has finished converting
+    bool PollAdcCompletion();
+
+    unsigned int getChipCount() const { return m_chipCount; }
+
+private:
+    static constexpr uint16_t modeBits(AdcMode mode) { return ((uint8_t)mode & 0b11) << 7; }
+
+    // Far longer than any read takes even at low SPI clock rates
+    static constexpr std::chrono::milliseconds kTransferTimeout = 10ms;
+
+    SPI* m_spi;
+    unsigned int m_chipCount;
+
+    // Command, PEC and one group + PEC per chip
+    std::vector<uint8_t> m_txBuffer;
+    std::vector<uint8_t> m_rxBuffer;
+
+    bool m_transferPending = false;
+    // The last StartReadCommand() found the peripheral busy
+    bool m_startFailed = false;
+    uint32_t m_failedChips = 0;
+#if DEVICE_SPI_ASYNCH
+    // Released from the SPI interrupt once a transfer completes
+    Semaphore m_transferDone;
+
+    void onTransferDone(int event);
+#endif
+
+    void loadCommand(const CommandFrame& command);
+    // Wait for a transfer started by StartReadCommand(), if there is one
+    Status waitForTransfer(uint32_t chips);
+};
+
+template <typename F>
+LTC6811ChainBus::Status LTC6811ChainBus::FinishReadCommand(F decode, uint32_t chips) {
+    if (m_chipCount < kMaxChips) {
+        chips &= (1u << m_chipCount) - 1;
+    }
+
+    Status status = waitForTransfer(chips);
+    if (status != Status::Ok) {
+        return status;
+    }
+
+    m_failedChips = 0;
+    const uint8_t* in = m_rxBuffer.data() + 4;
+    for (unsigned int i = 0; i < m_chipCount; i++, in += kGroupSize + 2) {
+        if ((chips & (1u << i)) && !decode(i, in)) {
+            m_failedChips |= 1u << i;
+            status = Status::PecError;
+        }
+    }
+
+    return status;
+}
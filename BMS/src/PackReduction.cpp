@@ -0,0 +1,197 @@
+#include "PackReduction.h"
+
+#include <cstring>
+
+#include "ThermistorTable.h"
+
+// The out of range values of the thermistor table are not temperatures
+static bool isReading(uint16_t) { return true; }
+static bool isReading(int8_t value) {
+  return value != kTempBelowRange && value != kTempAboveRange;
+}
+
+// Take one more value into a reduction, values have to come in index order
+template <typename T>
+static void add(Reduction<T> &r, T value, uint16_t index) {
+  if (r.count == 0 || value < r.min) {
+    r.min = value;
+    r.argMin = index;
+  }
+  if (r.count == 0 || value > r.max) {
+    r.max = value;
+    r.argMax = index;
+  }
+  r.sum += value;
+  r.count++;
+}
+
+template <typename T>
+static Reduction<T> reduceScalar(mbed::Span<const T> values) {
+  Reduction<T> r;
+  for (ptrdiff_t i = 0; i < values.size(); i++) {
+    if (isReading(values[i])) {
+      add(r, values[i], (uint16_t)i);
+    }
+  }
+  return r;
+}
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+// Take the extremes of one SIMD lane into a reduction. Lanes hold
+// interleaved indices, so equal values go to the lower index.
+template <typename T>
+static void mergeLane(Reduction<T> &r, bool first, T min, uint16_t argMin, T max,
+                      uint16_t argMax) {
+  if (first || min < r.min || (min == r.min && argMin < r.argMin)) {
+    r.min = min;
+    r.argMin = argMin;
+  }
+  if (first || max > r.max || (max == r.max && argMax < r.argMax)) {
+    r.max = max;
+    r.argMax = argMax;
+  }
+}
+#endif
+
+Reduction<uint16_t> reduce(mbed::Span<const uint16_t> values) {
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+  Reduction<uint16_t> r;
+  ptrdiff_t pairs = values.size() / 2;
+  if (pairs > 0) {
+    uint32_t minPair;
+    memcpy(&minPair, values.data(), 4);
+    uint32_t maxPair = minPair;
+    // Index of each lane, and of the extremes each lane has seen
+    uint32_t indices = 0x00010000;
+    uint32_t argMinPair = indices;
+    uint32_t argMaxPair = indices;
+    int32_t sum = 0;
+    for (ptrdiff_t i = 0; i < pairs; i++) {
+      uint32_t pair;
+      memcpy(&pair, values.data() + i * 2, 4);
+      // GE is set in the lanes where the kept value wins, SEL keeps those
+      // and takes the new value and its index in the rest
+      __USUB16(pair, minPair);
+      minPair = __SEL(minPair, pair);
+      argMinPair = __SEL(argMinPair, indices);
+      __USUB16(maxPair, pair);
+      maxPair = __SEL(maxPair, pair);
+      argMaxPair = __SEL(argMaxPair, indices);
+      // Both halfwords times one, cell voltages are far below 32768mV
+      sum = __SMLAD(pair, 0x00010001, sum);
+      indices += 0x00020002;
+    }
+    for (unsigned int lane = 0; lane < 2; lane++) {
+      unsigned int shift = lane * 16;
+      mergeLane(r, lane == 0, (uint16_t)(minPair >> shift), (uint16_t)(argMinPair >> shift),
+                (uint16_t)(maxPair >> shift), (uint16_t)(argMaxPair >> shift));
+    }
+    r.sum = sum;
+    r.count = pairs * 2;
+  }
+  if (values.size() % 2) {
+    add(r, values[values.size() - 1], (uint16_t)(values.size() - 1));
+  }
+  return r;
+#else
+  return reduceScalar(values);
+#endif
+}
+
+Reduction<int8_t> reduce(mbed::Span<const int8_t> values) {
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+  // Indices have a byte per lane
+  if (values.size() > 256) {
+    return reduceScalar(values);
+  }
+
+  static_assert(kTempBelowRange == INT8_MIN && kTempAboveRange == INT8_MAX,
+                "The packed path relies on the sentinels being the int8_t limits");
+
+  Reduction<int8_t> r;
+  ptrdiff_t quads = values.size() / 4;
+  if (quads > 0) {
+    // Every lane starts out empty: the minimum at kTempAboveRange and the
+    // maximum at kTempBelowRange, which any reading beats
+    uint32_t minQuad = 0x7F7F7F7F;
+    uint32_t maxQuad = 0x80808080;
+    uint32_t indices = 0x03020100;
+    uint32_t argMinQuad = indices;
+    uint32_t argMaxQuad = indices;
+    // Readings seen per lane, at most 64 each
+    uint32_t laneCounts = 0;
+    int32_t sum = 0;
+    for (ptrdiff_t i = 0; i < quads; i++) {
+      uint32_t quad;
+      memcpy(&quad, values.data() + i * 4, 4);
+      // Turn both sentinels into kTempAboveRange for the minimum, and into
+      // kTempBelowRange for the maximum, so they never win either
+      __SSUB8(quad, 0x81818181);
+      uint32_t forMin = __SEL(quad, 0x7F7F7F7F);
+      // GE now marks the lanes with a reading
+      __SSUB8(0x7E7E7E7E, forMin);
+      uint32_t forMax = __SEL(quad, 0x80808080);
+      uint32_t readings = __SEL(quad, 0);
+      laneCounts += __SEL(0x01010101, 0);
+
+      __SSUB8(forMin, minQuad);
+      minQuad = __SEL(minQuad, forMin);
+      argMinQuad = __SEL(argMinQuad, indices);
+      __SSUB8(maxQuad, forMax);
+      maxQuad = __SEL(maxQuad, forMax);
+      argMaxQuad = __SEL(argMaxQuad, indices);
+      // Bytes 0 and 2, then 1 and 3, sign extended to halfwords
+      sum = __SMLAD(__SXTB16(readings), 0x00010001, sum);
+      sum = __SMLAD(__SXTB16(__ROR(readings, 8)), 0x00010001, sum);
+      indices += 0x04040404;
+    }
+    uint16_t count = 0;
+    for (unsigned int lane = 0; lane < 4; lane++) {
+      unsigned int shift = lane * 8;
+      uint8_t laneCount = laneCounts >> shift;
+      if (laneCount == 0) {
+        continue;
+      }
+      mergeLane(r, count == 0, (int8_t)(minQuad >> shift), (uint16_t)(uint8_t)(argMinQuad >> shift),
+                (int8_t)(maxQuad >> shift), (uint16_t)(uint8_t)(argMaxQuad >> shift));
+      count += laneCount;
+    }
+    r.sum = sum;
+    r.count = count;
+  }
+  for (ptrdiff_t i = quads * 4; i < values.size(); i++) {
+    if (isReading(values[i])) {
+      add(r, values[i], (uint16_t)i);
+    }
+  }
+  return r;
+#else
+  return reduceScalar(values);
+#endif
+}
+
+Reduction<uint16_t> reduceCellVoltages(const PackSnapshot &snapshot, uint32_t skipBanks) {
+  if (skipBanks == 0) {
+    return reduce({snapshot.cellVoltages.data(), (ptrdiff_t)snapshot.cellVoltages.size()});
+  }
+  Reduction<uint16_t> r;
+  for (unsigned int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (!(skipBanks & (1u << i))) {
+      merge(r, reduce(snapshot.bankVoltages(i)), kPackTopology.cellOffset(i));
+    }
+  }
+  return r;
+}
+
+Reduction<int8_t> reduceTemperatures(const PackSnapshot &snapshot, uint32_t skipBanks) {
+  if (skipBanks == 0) {
+    return reduce({snapshot.cellTemperatures.data(), (ptrdiff_t)snapshot.cellTemperatures.size()});
+  }
+  Reduction<int8_t> r;
+  for (unsigned int i = 0; i < BMS_BANK_COUNT; i++) {
+    if (!(skipBanks & (1u << i))) {
+      merge(r, reduce(snapshot.bankTemperatures(i)), kPackTopology.thermistorOffset(i));
+    }
+  }
+  return r;
+}
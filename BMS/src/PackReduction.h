@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+
+#include "mbed.h"
+
+#include "PackSnapshot.h"
+
+// Extremes, sum and count of one quantity over the pack, found in a single
+// pass over its PackSnapshot array
+//
+// On cores with the DSP extension (Cortex-M4 and up) the pass works on every
+// halfword or byte of a word at once, with USUB16/SSUB8 and SEL keeping the
+// extremes and their indices lane by lane. Elsewhere, e.g. host builds, it is
+// a plain loop with the same results. Ties go to the lowest index.
+//
+// count is the number of values that went in, so a reduction over only some
+// of the banks averages over those.
+template <typename T>
+struct Reduction {
+    T min = 0;
+    T max = 0;
+    // Index of min and max in the array
+    uint16_t argMin = 0;
+    uint16_t argMax = 0;
+    int32_t sum = 0;
+    uint16_t count = 0;
+
+    // returns: 0 for an empty array
+    T average() const { return count == 0 ? 0 : sum / count; }
+};
+
+// values: cell voltages
+Reduction<uint16_t> reduce(mbed::Span<const uint16_t> values);
+// values: temperatures, up to 256 of them go through the packed path. The
+//         kTempBelowRange and kTempAboveRange values of a thermistor off its
+//         curve are not temperatures and are left out, count only has the
+//         readings in it.
+Reduction<int8_t> reduce(mbed::Span<const int8_t> values);
+
+// Take the reduction of a later part of the same array into another
+//
+// offset: index of the first value of part in the array
+template <typename T>
+void merge(Reduction<T>& into, const Reduction<T>& part, uint16_t offset) {
+    if (part.count == 0) {
+        return;
+    }
+    // Parts come in index order, so ties stay with the earlier one
+    if (into.count == 0 || part.min < into.min) {
+        into.min = part.min;
+        into.argMin = part.argMin + offset;
+    }
+    if (into.count == 0 || part.max > into.max) {
+        into.max = part.max;
+        into.argMax = part.argMax + offset;
+    }
+    into.sum += part.sum;
+    into.count += part.count;
+}
+
+// Reduce the cell voltages or temperatures of a snapshot, leaving out some
+// banks, e.g. the ones that weren't read this scan. Indices stay in pack order.
+//
+// skipBanks: bank 0 in the LSB
+Reduction<uint16_t> reduceCellVoltages(const PackSnapshot& snapshot, uint32_t skipBanks);
+Reduction<int8_t> reduceTemperatures(const PackSnapshot& snapshot, uint32_t skipBanks);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "mbed.h"
+
+#include "BmsConfig.h"
+
+// Latest measurements of the whole pack, one array per quantity
+//
+// Register groups are decoded straight into these arrays from the bus receive
+// buffers, so a scan needs no buffers of its own. Values of chips that could
+// not be read keep whatever the previous scan left there.
+struct PackSnapshot {
+    // Cell voltages in pack order (see kPackTopology)
+    //
+    // Units: millivolts
+    alignas(4) std::array<uint16_t, BMS_CELL_COUNT> cellVoltages{};
+
+    // Thermistor temperatures in pack order
+    //
+    // Units: degrees celcius
+    alignas(4) std::array<int8_t, BMS_TEMP_COUNT> cellTemperatures{};
+
+    // Die temperature of the monitor of every bank, measured while balancing
+    //
+    // Units: degrees celcius
+    std::array<int8_t, BMS_BANK_COUNT> dieTemperatures{};
+
+    // One bit for every bank, without shifting past the width at 32 banks
+    static constexpr uint32_t kAllBanks =
+        BMS_BANK_COUNT >= 32 ? 0xFFFFFFFF : (1u << BMS_BANK_COUNT) - 1;
+
+    // Bits of cellHealth
+    //
+    // kOpenWire: the ADOW check found a wire of the cell open
+    static constexpr uint8_t kOpenWire = 1 << 0;
+
+    // Results of the background diagnostics of every cell in pack order, kept
+    // until the diagnostic runs on that cell again
+    std::array<uint8_t, BMS_CELL_COUNT> cellHealth{};
+
+    // Banks whose cell voltages or temperatures could not all be read in the
+    // last scan, bank 0 in the LSB. Their values are from an older scan, or
+    // still zero if they were never read.
+    uint32_t staleVoltageBanks = kAllBanks;
+    uint32_t staleTemperatureBanks = kAllBanks;
+
+    mbed::Span<const uint16_t> bankVoltages(unsigned int bank) const {
+        return {cellVoltages.data() + kPackTopology.cellOffset(bank),
+                (ptrdiff_t)kPackTopology.cellCount(bank)};
+    }
+
+    mbed::Span<const int8_t> bankTemperatures(unsigned int bank) const {
+        return {cellTemperatures.data() + kPackTopology.thermistorOffset(bank),
+                (ptrdiff_t)kPackTopology.thermistorCount(bank)};
+    }
+};
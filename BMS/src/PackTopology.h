@@ -0,0 +1,164 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Compile time description of how the pack is wired to the monitors
+//
+// Every bank lists the monitor cell pins that have a cell connected and how
+// many thermistor mux channels it uses, so banks don't all need the same
+// number of cells. Cells are numbered bank by bank in pin order, and
+// thermistors bank by bank in mux channel order. The tables the scan loops
+// work from are generated from this at compile time, so those loops only
+// visit connected pins.
+
+// Cells and thermistors wired to one monitor
+struct BankLayout {
+    // Bit mask of the cell pins with a cell connected, C1 in the LSB
+    uint32_t cellPins;
+    // Thermistor mux channels in use, starting from channel 0
+    uint8_t thermistors;
+};
+
+// A connected cell pin
+struct CellSlot {
+    // Bank (chip) the cell is on
+    uint8_t bank;
+    // Cell pin of the monitor, 0 for C1
+    uint8_t pin;
+    // Index of the cell in the pack
+    uint16_t cell;
+};
+
+constexpr unsigned int countPins(uint32_t pins) {
+    unsigned int count = 0;
+    for (; pins != 0; pins &= pins - 1) {
+        count++;
+    }
+    return count;
+}
+
+template <size_t Banks>
+class PackTopology {
+public:
+    static constexpr size_t kBankCount = Banks;
+
+    std::array<BankLayout, Banks> banks;
+
+    constexpr unsigned int bankCount() const { return Banks; }
+
+    constexpr uint32_t cellPins(unsigned int bank) const { return banks[bank].cellPins; }
+    constexpr unsigned int cellCount(unsigned int bank) const {
+        return countPins(banks[bank].cellPins);
+    }
+    // Pack index of the first cell of a bank
+    constexpr unsigned int cellOffset(unsigned int bank) const {
+        unsigned int offset = 0;
+        for (unsigned int i = 0; i < bank; i++) {
+            offset += cellCount(i);
+        }
+        return offset;
+    }
+    constexpr unsigned int totalCells() const { return cellOffset(Banks); }
+    // Pack index of the cell on a connected pin
+    constexpr unsigned int cellIndex(unsigned int bank, unsigned int pin) const {
+        return cellOffset(bank) + countPins(banks[bank].cellPins & ((1u << pin) - 1));
+    }
+
+    constexpr unsigned int thermistorCount(unsigned int bank) const {
+        return banks[bank].thermistors;
+    }
+    // Pack index of the first thermistor of a bank
+    constexpr unsigned int thermistorOffset(unsigned int bank) const {
+        unsigned int offset = 0;
+        for (unsigned int i = 0; i < bank; i++) {
+            offset += banks[i].thermistors;
+        }
+        return offset;
+    }
+    constexpr unsigned int totalThermistors() const { return thermistorOffset(Banks); }
+    // Mux channels a scan has to step through to cover every bank
+    constexpr unsigned int maxThermistors() const {
+        unsigned int most = 0;
+        for (const BankLayout& bank : banks) {
+            most = bank.thermistors > most ? bank.thermistors : most;
+        }
+        return most;
+    }
+
+    // Whether every connected pin exists on a monitor with pinCount cell pins
+    constexpr bool fitsMonitor(unsigned int pinCount) const {
+        uint32_t allowed = pinCount >= 32 ? 0xFFFFFFFF : (1u << pinCount) - 1;
+        for (const BankLayout& bank : banks) {
+            if (bank.cellPins & ~allowed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Every bank has at least one cell, and the 3 bit mux has 8 channels
+    constexpr bool isValid() const {
+        for (const BankLayout& bank : banks) {
+            if (bank.cellPins == 0 || bank.thermistors > 8) {
+                return false;
+            }
+        }
+        return Banks > 0;
+    }
+};
+
+// Every connected cell in pack order
+//
+// Cells: topology.totalCells()
+template <unsigned int Cells, size_t Banks>
+constexpr std::array<CellSlot, Cells> makeCellSlots(const PackTopology<Banks>& topology) {
+    std::array<CellSlot, Cells> slots{};
+    unsigned int cell = 0;
+    for (unsigned int bank = 0; bank < Banks; bank++) {
+        for (unsigned int pin = 0; pin < 32; pin++) {
+            if (topology.cellPins(bank) & (1u << pin)) {
+                slots[cell] = {(uint8_t)bank, (uint8_t)pin, (uint16_t)cell};
+                cell++;
+            }
+        }
+    }
+    return slots;
+}
+
+// Connected cells ordered by the cell voltage register group (three pins
+// each) they are read back in, so each group unpacks from one contiguous run
+//
+// Cells: topology.totalCells()
+template <unsigned int Cells, size_t Banks>
+constexpr std::array<CellSlot, Cells> makeGroupedCellSlots(const PackTopology<Banks>& topology) {
+    std::array<CellSlot, Cells> slots = makeCellSlots<Cells>(topology);
+    std::array<CellSlot, Cells> grouped{};
+    unsigned int next = 0;
+    for (unsigned int group = 0; group * 3 < 32; group++) {
+        for (const CellSlot& slot : slots) {
+            if (slot.pin / 3 == group) {
+                grouped[next++] = slot;
+            }
+        }
+    }
+    return grouped;
+}
+
+// Index into makeGroupedCellSlots() of the first cell of each bank in each
+// register group, group major, with one extra entry marking the end of the
+// last bank of the last group. Within a group, banks follow each other in
+// order, so the cells of one bank in one group are a contiguous run.
+template <unsigned int Groups, size_t Banks>
+constexpr std::array<uint16_t, Groups * Banks + 1> makeSlotStarts(
+        const PackTopology<Banks>& topology) {
+    std::array<uint16_t, Groups * Banks + 1> starts{};
+    for (unsigned int group = 0; group < Groups; group++) {
+        for (unsigned int bank = 0; bank < Banks; bank++) {
+            unsigned int i = group * Banks + bank;
+            starts[i + 1] = starts[i] + countPins(topology.cellPins(bank) & (0b111u << (group * 3)));
+        }
+    }
+    return starts;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Packet error code (PEC15) from the LTC681x datasheets
+//
+// CRC-15 with polynomial 0x4599 and seed 16, sent MSB first in two bytes with
+// the LSB always 0. Computed a byte at a time from a 256 entry table that is
+// built at compile time.
+
+constexpr std::array<uint16_t, 256> makePec15Table() {
+    std::array<uint16_t, 256> table{};
+    for (unsigned int i = 0; i < 256; i++) {
+        uint16_t remainder = i << 7;
+        for (int bit = 0; bit < 8; bit++) {
+            if (remainder & 0x4000) {
+                remainder = (uint16_t)((remainder << 1) ^ 0x4599);
+            } else {
+                remainder = (uint16_t)(remainder << 1);
+            }
+        }
+        table[i] = remainder;
+    }
+    return table;
+}
+
+inline constexpr std::array<uint16_t, 256> kPec15Table = makePec15Table();
+
+constexpr uint16_t calculatePec15(const uint8_t* data, unsigned int length) {
+    uint16_t remainder = 16;
+    for (unsigned int i = 0; i < length; i++) {
+        uint8_t index = ((remainder >> 7) ^ data[i]) & 0xFF;
+        remainder = (uint16_t)((remainder << 8) ^ kPec15Table[index]);
+    }
+    return (uint16_t)(remainder << 1);
+}
+
+// Check data against the two PEC bytes that follow it
+constexpr bool checkPec15(const uint8_t* data, unsigned int length) {
+    uint16_t pec = ((uint16_t)data[length] << 8) | data[length + 1];
+    return calculatePec15(data, length) == pec;
+}
+
+// Command word and its PEC, as shifted out at the start of every transaction
+using CommandFrame = std::array<uint8_t, 4>;
+
+// Frame for a broadcast command, the address bits stay clear
+constexpr CommandFrame makeCommandFrame(uint16_t command) {
+    CommandFrame frame{};
+    frame[0] = (command >> 8) & 0x07;
+    frame[1] = command & 0xFF;
+    uint16_t pec = calculatePec15(frame.data(), 2);
+    frame[2] = pec >> 8;
+    frame[3] = pec & 0xFF;
+    return frame;
+}
+
+// Frame for the same command sent to a single LTC6811-2, address 0 to 15
+constexpr CommandFrame makeAddressedCommandFrame(const CommandFrame& broadcast, uint8_t address) {
+    CommandFrame frame{};
+    frame[0] = 0x80 | ((address & 0x0F) << 3) | broadcast[0];
+    frame[1] = broadcast[1];
+    uint16_t pec = calculatePec15(frame.data(), 2);
+    frame[2] = pec >> 8;
+    frame[3] = pec & 0xFF;
+    return frame;
+}
+
+static_assert(makeCommandFrame(0x001)[2] == 0x3D && makeCommandFrame(0x001)[3] == 0x6E,
+              "PEC15 of WRCFGA does not match the datasheet");
+static_assert(makeCommandFrame(0x714)[2] == 0xF3 && makeCommandFrame(0x714)[3] == 0x6C,
+              "PEC15 of PLADC does not match");
@@ -0,0 +1,61 @@
+#include "ScanExecutor.h"
+
+using namespace std::chrono;
+
+bool ScanExecutor::add(ScanTask *task) {
+  if (m_taskCount >= kMaxTasks) {
+    return false;
+  }
+  m_tasks[m_taskCount] = task;
+  m_wakeTimes[m_taskCount] = 0us;
+  m_taskCount++;
+  return true;
+}
+
+void ScanExecutor::run() {
+  m_timer.reset();
+  m_timer.start();
+
+  unsigned int remaining = m_taskCount;
+  while (remaining > 0) {
+    // Earliest due task first, ties go to the lowest index
+    unsigned int next = kMaxTasks;
+    for (unsigned int i = 0; i < m_taskCount; i++) {
+      if (m_tasks[i] != nullptr &&
+          (next == kMaxTasks || m_wakeTimes[i] < m_wakeTimes[next])) {
+        next = i;
+      }
+    }
+
+    sleepUntil(m_wakeTimes[next]);
+
+    microseconds now = m_timer.elapsed_time();
+    std::optional<microseconds> delay = m_tasks[next]->step(now);
+    if (delay) {
+      m_wakeTimes[next] = now + *delay;
+    } else {
+      m_tasks[next] = nullptr;
+      remaining--;
+    }
+  }
+
+  m_timer.stop();
+  m_taskCount = 0;
+}
+
+void ScanExecutor::sleepUntil(microseconds wakeTime) {
+  microseconds now = m_timer.elapsed_time();
+  if (wakeTime <= now) {
+    return;
+  }
+
+  // RTOS sleeps only have millisecond resolution, spin for the rest
+  auto sleepTime = duration_cast<milliseconds>(wakeTime - now);
+  if (sleepTime.count() > 0) {
+    ThisThread::sleep_for(sleepTime);
+  }
+  now = m_timer.elapsed_time();
+  if (now < wakeTime) {
+    wait_us((wakeTime - now).count());
+  }
+}
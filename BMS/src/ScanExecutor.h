@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+#include "mbed.h"
+#include "rtos.h"
+
+// One job run by ScanExecutor, written as a stackless state machine
+//
+// Each call to step() does the bus work for the current state, moves to the
+// next state and returns instead of blocking. Waiting on a conversion or a
+// settle time is done by returning how long to wait, so other tasks get the
+// bus in the meantime.
+class ScanTask {
+public:
+    virtual ~ScanTask() = default;
+
+    // Advance the task
+    //
+    // now: time since the executor started
+    // returns: how long to wait before the next step, or nullopt once done
+    virtual std::optional<std::chrono::microseconds> step(std::chrono::microseconds now) = 0;
+};
+
+// Runs several ScanTasks on the calling thread until all of them are done
+//
+// Used by the per-chip thermistor scan (BMS_TEMP_SCAN_BROADCAST 0). The
+// broadcast and daisy chain scans convert every bank with one command, so
+// they have nothing to interleave and don't go through it.
+//
+// Whichever task is due next gets stepped. When none are due, the thread
+// sleeps until the earliest one is, so the tasks need no stacks of their own.
+class ScanExecutor {
+public:
+    // Most tasks run at once, one per bank
+    static constexpr unsigned int kMaxTasks = 16;
+
+    // returns: false if the task table is full
+    bool add(ScanTask* task);
+
+    // Step every added task until all are done, then forget them
+    void run();
+
+private:
+    ScanTask* m_tasks[kMaxTasks];
+    std::chrono::microseconds m_wakeTimes[kMaxTasks];
+    unsigned int m_taskCount = 0;
+
+    Timer m_timer;
+
+    void sleepUntil(std::chrono::microseconds wakeTime);
+};
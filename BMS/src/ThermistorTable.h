@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Direct index lookup from thermistor voltage to temperature
+//
+// A thermistor curve is given as a handful of measured points. The lookup
+// table interpolates between them at compile time for every millivolt the
+// curve covers, so converting a reading is a range check and a single load.
+
+// Returned for voltages above the curve, i.e. colder than its first point
+// (also what an open thermistor reads)
+constexpr int8_t kTempBelowRange = INT8_MIN;
+// Returned for voltages below the curve, i.e. hotter than its last point
+constexpr int8_t kTempAboveRange = INT8_MAX;
+
+// One point of a thermistor curve
+struct ConversionPoint {
+    // Units: degrees celcius
+    int8_t temp;
+    // Units: millivolts
+    uint16_t voltage;
+};
+
+// Points in order of rising temperature, with voltage falling along them as
+// it does for an NTC divider
+template <size_t Points>
+constexpr bool isValidCurve(const std::array<ConversionPoint, Points>& points) {
+    for (size_t i = 1; i < Points; i++) {
+        if (points[i].temp <= points[i - 1].temp || points[i].voltage >= points[i - 1].voltage) {
+            return false;
+        }
+    }
+    return Points > 1;
+}
+
+// Temperature of every millivolt from the last (hottest) point of a curve to
+// the first, rounded to the nearest degree
+//
+// Size: points.front().voltage - points.back().voltage + 1
+template <size_t Size, size_t Points>
+constexpr std::array<int8_t, Size> makeThermistorTable(
+        const std::array<ConversionPoint, Points>& points) {
+    std::array<int8_t, Size> table{};
+    uint16_t lowest = points[Points - 1].voltage;
+    for (size_t i = 1; i < Points; i++) {
+        // Segment from the colder point (higher voltage) to the hotter one
+        const ConversionPoint& cold = points[i - 1];
+        const ConversionPoint& hot = points[i];
+        int span = cold.voltage - hot.voltage;
+        for (int voltage = hot.voltage; voltage <= cold.voltage; voltage++) {
+            int offset = (voltage - hot.voltage) * (cold.temp - hot.temp);
+            // Round half away from zero, offset is never positive
+            table[voltage - lowest] = hot.temp + (offset - span / 2) / span;
+        }
+    }
+    return table;
+}
+
+// Voltage to temperature conversion of one thermistor curve
+//
+// Curve: type with a static constexpr std::array<ConversionPoint, N> kPoints,
+//        see isValidCurve()
+template <typename Curve>
+class ThermistorTable {
+public:
+    static_assert(isValidCurve(Curve::kPoints), "Thermistor curve is not monotonic");
+
+    // Units: millivolts
+    static constexpr uint16_t kMinVoltage = Curve::kPoints.back().voltage;
+    static constexpr uint16_t kMaxVoltage = Curve::kPoints.front().voltage;
+
+    // voltage: in mV
+    // returns: temperature in degrees celcius, or kTempBelowRange or
+    //          kTempAboveRange off the ends of the curve
+    static constexpr int8_t convert(uint16_t voltage) {
+        if (voltage > kMaxVoltage) {
+            return kTempBelowRange;
+        }
+        if (voltage < kMinVoltage) {
+            return kTempAboveRange;
+        }
+        return kTable[voltage - kMinVoltage];
+    }
+
+private:
+    static constexpr std::array<int8_t, kMaxVoltage - kMinVoltage + 1> kTable =
+        makeThermistorTable<kMaxVoltage - kMinVoltage + 1>(Curve::kPoints);
+};
@@ -10,6 +10,7 @@
 #include "mbed.h"
 
 #include "LTC681xParallelBus.h"
+#include "LTC6811ChainBus.h"
 #include "BmsThread.h"
 //
 // #include "Can.h"
@@ -58,9 +59,9 @@ void initIO();
 // uint8_t canCount;
 
 
-// DigitalIn shutdown_measure_pin(ACC_SHUTDOWN_MEASURE);
+DigitalIn shutdown_measure_pin(ACC_SHUTDOWN_MEASURE);
 // DigitalIn imd_status_pin(ACC_IMD_STATUS);
-// DigitalIn charge_state_pin(ACC_CHARGE_STATE);
+DigitalIn charge_state_pin(ACC_CHARGE_STATE);
 
 
 // DigitalOut fan_control_pin(ACC_FAN_CONTROL);
@@ -78,20 +79,25 @@ void initIO();
 
 // bool prechargeDone = false;
 // bool hasBmsFault = true;
-// bool isCharging = false;
+bool isCharging = false;
 // bool hasFansOn = false;
 // bool isBalancing = false;
 
 // bool chargeEnable = false;
 
 // uint16_t dcBusVoltage; // in tenths of volts
-// uint32_t tsVoltagemV;
+uint32_t tsVoltagemV;
+Kernel::Clock::time_point tsVoltageTimestamp;
 //uint16_t tsVoltage;
 // uint8_t glvVoltage;
 // uint16_t tsCurrent;
 
-uint16_t allVoltages[BMS_BANK_COUNT*BMS_BANK_CELL_COUNT];
-int8_t allTemps[BMS_BANK_COUNT*BMS_BANK_TEMP_COUNT];
+LinkHealth linkHealth[BMS_BANK_COUNT];
+ChipDiagnostics chipDiagnostics[BMS_BANK_COUNT];
+BootTimings bootTimings;
+// Whether the last BmsEvent passed its self tests, nothing is taken from the
+// BMS until then
+bool bmsValidated = false;
 
 int8_t avgCellTemp; // in c
 int8_t maxCellTemp; // in c
@@ -111,30 +117,47 @@ int main() {
                            use_gpio_ssel);
   spiDriver->format(8, 0);
   auto ltcBus = LTC681xParallelBus(spiDriver);
+  std::vector<LTC6811ChainBus*> chains;
+  LTC6811ChainBus* addressedReader = nullptr;
+#if BMS_ISOSPI_CHAIN
+#if BMS_ISOSPI_CHAIN_COUNT > 1
+  // First chain gets the odd bank if the banks don't split evenly
+  SPI* spiDriver2 = new SPI(BMS_PIN_SPI2_MOSI,
+                            BMS_PIN_SPI2_MISO,
+                            BMS_PIN_SPI2_SCLK,
+                            BMS_PIN_SPI2_SSEL,
+                            use_gpio_ssel);
+  spiDriver2->format(8, 0);
+  chains.push_back(new LTC6811ChainBus(spiDriver, BMS_BANK_COUNT - BMS_BANK_COUNT / 2));
+  chains.push_back(new LTC6811ChainBus(spiDriver2, BMS_BANK_COUNT / 2));
+#else
+  chains.push_back(new LTC6811ChainBus(spiDriver, BMS_BANK_COUNT));
+#endif
+#else
+  // Asynchronous register reads of the parallel bus, one chip at a time
+  addressedReader = new LTC6811ChainBus(spiDriver, 1);
+#endif
 
   BmsEventMailbox* bmsMailbox = new BmsEventMailbox();
   MainToBMSMailbox* mainToBMSMailbox = new MainToBMSMailbox();
+  PackVoltageMailbox* packVoltageMailbox = new PackVoltageMailbox();
 
   Thread bmsThreadThread;
-  BMSThread bmsThread(ltcBus, 1, bmsMailbox, mainToBMSMailbox);
-  bmsThreadThread.start(callback(&BMSThread::startThread, &bmsThread));
+  BMSThread<BmsChip> bmsThread(ltcBus, 1, bmsMailbox, mainToBMSMailbox, packVoltageMailbox, chains, addressedReader);
+  bmsThreadThread.start(callback(&BMSThread<BmsChip>::startThread, &bmsThread));
   printf("BMS thread started\n");
 
-  Timer t;
-  t.start();
+  // Loop on the kernel clock rather than a Timer, a running Timer keeps the
+  // MCU out of deep sleep
+  bool parked = false;
+  // What the BMS thread was last told, it is only woken up for a change
+  MainToBMSEvent lastMainToBMS;
+  bool mainToBMSPosted = false;
   while (1) {
     // glvVoltage = (uint8_t)(glv_voltage_pin * 185.3); // in mV
     //printf("GLV voltage: %d mV\n", glvVoltage * 100);
 
-    while (!bmsMailbox->empty()) {
-        BmsEvent *bmsEvent;
-
-        osEvent evt = bmsMailbox->get();
-        if (evt.status == osEventMessage) {
-            bmsEvent = (BmsEvent*)evt.value.p;
-        } else {
-            continue;
-        }
+    while (BmsEvent *bmsEvent = bmsMailbox->try_get()) {
 
         switch (bmsEvent->bmsState) {
             case BMSThreadState::BMSStartup:
@@ -144,20 +167,39 @@ int main() {
                 // printf("BMS Fault Idle State\n");
                 // hasBmsFault = false;
 
+                if (bmsEvent->validated != bmsValidated) {
+                    printf(bmsEvent->validated ? "BMS self tests passed\n"
+                                               : "BMS not validated, ignoring its measurements\n");
+                }
+                bmsValidated = bmsEvent->validated;
+                if (!bmsValidated) {
+                    break;
+                }
+
                 maxCellTemp = bmsEvent->maxTemp;
                 avgCellTemp = bmsEvent->avgTemp;
+                if (bmsEvent->thermistorFaults > 0) {
+                    printf("%d thermistors not reading, left out of the temperatures\n",
+                           bmsEvent->thermistorFaults);
+                }
                 // isBalancing = bmsEvent->isBalancing;
 
-                // tsVoltagemV = 0;
+                // Refreshed in between by the pack voltage fast path
+                tsVoltagemV = bmsEvent->packVoltage;
 
-                for (int i = 0; i < BMS_BANK_COUNT*BMS_BANK_CELL_COUNT; i++) {
-                    allVoltages[i] = bmsEvent->voltageValues[i];
-                    // tsVoltagemV += allVoltages[i];
-                    printf("%d, V: %d\n", i, allVoltages[i]);
+                for (int i = 0; i < BMS_BANK_COUNT; i++) {
+                    if ((bmsEvent->snapshot.staleVoltageBanks | bmsEvent->snapshot.staleTemperatureBanks) & (1u << i)) {
+                        printf("Bank %d not read, its values are from an older scan\n", i);
+                    }
+                }
+                for (int i = 0; i < BMS_CELL_COUNT; i++) {
+                    printf("%d, V: %d\n", i, bmsEvent->snapshot.cellVoltages[i]);
+                    if (bmsEvent->snapshot.cellHealth[i] & PackSnapshot::kOpenWire) {
+                        printf("%d, open wire\n", i);
+                    }
                 }
-                for (int i = 0; i < BMS_BANK_COUNT*BMS_BANK_TEMP_COUNT; i++) {
-                    allTemps[i] = bmsEvent->temperatureValues[i];
-                    printf("%d, T: %d\n", i, allTemps[i]);
+                for (int i = 0; i < BMS_TEMP_COUNT; i++) {
+                    printf("%d, T: %d\n", i, bmsEvent->snapshot.cellTemperatures[i]);
                 }
 
                 break;
@@ -173,7 +215,44 @@ int main() {
                 printf("FUBAR\n");
                 break;
         }
-        delete bmsEvent;
+
+        // Report banks whose isoSPI link is picking up errors
+        for (int i = 0; i < BMS_BANK_COUNT; i++) {
+            const LinkHealth &health = bmsEvent->linkHealth[i];
+            if (health.pecErrors != linkHealth[i].pecErrors ||
+                health.timeouts != linkHealth[i].timeouts) {
+                printf("Bank %d link: %lu PEC errors, %lu timeouts, %lu retries\n", i,
+                       (unsigned long)health.pecErrors, (unsigned long)health.timeouts,
+                       (unsigned long)health.retries);
+            }
+            linkHealth[i] = health;
+
+            // Self tests whose outcome changed, bits as in ChipDiagnostics
+            const ChipDiagnostics &diagnostics = bmsEvent->diagnostics[i];
+            if (diagnostics.failed != chipDiagnostics[i].failed) {
+                printf("Bank %d self tests failing: %x\n", i, diagnostics.failed);
+            }
+            chipDiagnostics[i] = diagnostics;
+        }
+
+        // Startup phases as they complete, to compare between firmware versions
+        const BootTimings &boot = bmsEvent->boot;
+        if (boot.firstSnapshot != bootTimings.firstSnapshot || boot.selfTests != bootTimings.selfTests) {
+            printf("Boot: bus %lld ms, first scan %lld ms, first snapshot %lld ms, self tests %lld ms\n",
+                   (long long)boot.busReady.count(), (long long)boot.firstScan.count(),
+                   (long long)boot.firstSnapshot.count(), (long long)boot.selfTests.count());
+            bootTimings = boot;
+        }
+        bmsMailbox->free(bmsEvent);
+    }
+
+    while (PackVoltageEvent *packVoltageEvent = packVoltageMailbox->try_get()) {
+
+        if (packVoltageEvent->plausible && bmsValidated) {
+            tsVoltagemV = packVoltageEvent->packVoltage;
+            tsVoltageTimestamp = packVoltageEvent->timestamp;
+        }
+        packVoltageMailbox->free(packVoltageEvent);
     }
 
     // CANMessage readmsg;
@@ -199,11 +278,26 @@ int main() {
     //     }
     // }
 
-    if (!mainToBMSMailbox->full()) {
-        MainToBMSEvent* mainToBMSEvent = new MainToBMSEvent();
-        // mainToBMSEvent->balanceAllowed = shutdown_measure_pin;
-        // mainToBMSEvent->charging = isCharging;
-        mainToBMSMailbox->put(mainToBMSEvent);
+    isCharging = charge_state_pin;
+    bool wasParked = parked;
+    parked = !shutdown_measure_pin && !isCharging;
+    if (parked != wasParked) {
+        // The RX interrupt of the buffered stdio holds a deep sleep lock, and
+        // nothing reads stdin while parked
+        mbed_file_handle(STDIN_FILENO)->enable_input(!parked);
+    }
+
+    if (!mainToBMSPosted || isCharging != lastMainToBMS.charging ||
+        parked != lastMainToBMS.parked) {
+        if (!mainToBMSMailbox->full()) {
+            MainToBMSEvent* mainToBMSEvent = new MainToBMSEvent();
+            // mainToBMSEvent->balanceAllowed = shutdown_measure_pin;
+            mainToBMSEvent->charging = isCharging;
+            mainToBMSEvent->parked = parked;
+            lastMainToBMS = *mainToBMSEvent;
+            mainToBMSPosted = true;
+            mainToBMSMailbox->put(mainToBMSEvent);
+        }
     }
 
 
@@ -233,7 +327,6 @@ int main() {
 
 
 
-    // isCharging = charge_state_pin;
     // printf("charge state: %x\n", isCharging);
 
     // precharge_control_pin = prechargeDone /*false*/;
@@ -261,7 +354,12 @@ int main() {
     // printf("Error Rx %d - tx %d\n", canBus->rderror(),canBus->tderror());
 
     // queue.dispatch_once();
-    ThisThread::sleep_for(5 - (t.read_ms()%5));
+    // Slow down with the BMS while parked, a wake condition still shows up
+    // well within one parked scan period
+    constexpr std::chrono::milliseconds parkedPeriod(BMS_PARKED_MAIN_PERIOD);
+    auto period = parked ? parkedPeriod : 5ms;
+    auto now = Kernel::Clock::now();
+    ThisThread::sleep_until(now - now.time_since_epoch() % period + period);
   }
 }
 
@@ -0,0 +1,107 @@
+#ifndef _TEST_BALANCE_PLANNER_H_
+#define _TEST_BALANCE_PLANNER_H_
+
+
+#include "test_main.h"
+#include "BalancePlanner.h"
+#include "PackSnapshot.h"
+#include "mbed.h"
+#include "unity.h"
+#include <iostream>
+
+
+// A pack read completely at 4V and room temperature, above the balance threshold
+static PackSnapshot balancedPack() {
+    PackSnapshot snapshot;
+    snapshot.cellVoltages.fill(4000);
+    snapshot.cellTemperatures.fill(25);
+    snapshot.dieTemperatures.fill(30);
+    snapshot.staleVoltageBanks = 0;
+    snapshot.staleTemperatureBanks = 0;
+    return snapshot;
+}
+
+static uint32_t bankDischarge(const uint32_t *masks) {
+    uint32_t any = 0;
+    for (unsigned int bank = 0; bank < BMS_BANK_COUNT; bank++) {
+        any |= masks[bank];
+    }
+    return any;
+}
+
+void test_balance_nothing_read() {
+    // The snapshot as it is at boot: all zero, nothing read yet
+    PackSnapshot snapshot;
+    uint32_t masks[BMS_BANK_COUNT];
+
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(0, bankDischarge(masks));
+}
+
+void test_balance_bank_missing() {
+    PackSnapshot snapshot = balancedPack();
+    snapshot.cellVoltages[kPackTopology.cellOffset(0)] = 4100;
+    // Bank 2 left over from an older scan at a lower voltage
+    for (unsigned int i = 0; i < kPackTopology.cellCount(2); i++) {
+        snapshot.cellVoltages[kPackTopology.cellOffset(2) + i] = 3950;
+    }
+    snapshot.staleVoltageBanks = 1u << 2;
+    uint32_t masks[BMS_BANK_COUNT];
+
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(0, bankDischarge(masks));
+}
+
+void test_balance_bank_zero() {
+    PackSnapshot snapshot = balancedPack();
+    snapshot.cellVoltages[kPackTopology.cellOffset(0)] = 4100;
+    // Bank 3 never read
+    for (unsigned int i = 0; i < kPackTopology.cellCount(3); i++) {
+        snapshot.cellVoltages[kPackTopology.cellOffset(3) + i] = 0;
+    }
+    snapshot.staleVoltageBanks = 1u << 3;
+    uint32_t masks[BMS_BANK_COUNT];
+
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(0, bankDischarge(masks));
+
+    // Once it is read the pack gets planned from the real lowest cell
+    snapshot = balancedPack();
+    snapshot.cellVoltages[kPackTopology.cellOffset(0)] = 4100;
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(1, masks[0]);
+    TEST_ASSERT_EQUAL(0, bankDischarge(masks) & ~masks[0]);
+}
+
+void test_balance_high_cell() {
+    PackSnapshot snapshot = balancedPack();
+    snapshot.cellVoltages[kPackTopology.cellIndex(1, 7)] = 4050;
+    uint32_t masks[BMS_BANK_COUNT];
+
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    for (unsigned int bank = 0; bank < BMS_BANK_COUNT; bank++) {
+        TEST_ASSERT_EQUAL(bank == 1 ? 1u << 7 : 0, masks[bank]);
+    }
+}
+
+void test_balance_bank_goes_missing() {
+    PackSnapshot snapshot = balancedPack();
+    snapshot.cellVoltages[kPackTopology.cellIndex(1, 7)] = 4050;
+    uint32_t masks[BMS_BANK_COUNT];
+
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(1u << 7, masks[1]);
+
+    // The plan stands, but a bank that wasn't read doesn't bleed
+    snapshot.staleVoltageBanks = 1u << 1;
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(0, masks[1]);
+
+    snapshot.staleVoltageBanks = 0;
+    snapshot.staleTemperatureBanks = 1u << 1;
+    balancePlanner->update(snapshot, true, Kernel::Clock::now(), masks);
+    TEST_ASSERT_EQUAL(0, masks[1]);
+}
+
+
+#endif  // _TEST_BALANCE_PLANNER_H_
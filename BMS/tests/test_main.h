@@ -0,0 +1,11 @@
+#ifndef _TEST_MAIN_H_
+#define _TEST_MAIN_H_
+
+
+#include "BalancePlanner.h"
+
+
+extern BalancePlanner *balancePlanner;
+
+
+#endif  // _TEST_MAIN_H_
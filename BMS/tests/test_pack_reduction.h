@@ -0,0 +1,106 @@
+#ifndef _TEST_PACK_REDUCTION_H_
+#define _TEST_PACK_REDUCTION_H_
+
+
+#include "test_main.h"
+#include "PackReduction.h"
+#include "PackSnapshot.h"
+#include "ThermistorTable.h"
+#include "mbed.h"
+#include "unity.h"
+#include <iostream>
+
+
+void test_reduce_ties_lowest_index() {
+    const uint16_t voltages[] = {3800, 3700, 3700, 3900, 3900, 3800};
+    Reduction<uint16_t> r = reduce(mbed::Span<const uint16_t>(voltages, 6));
+    TEST_ASSERT_EQUAL(3700, r.min);
+    TEST_ASSERT_EQUAL(1, r.argMin);
+    TEST_ASSERT_EQUAL(3900, r.max);
+    TEST_ASSERT_EQUAL(3, r.argMax);
+
+    // Every value the same, both extremes are the first one
+    const int8_t temperatures[] = {25, 25, 25, 25, 25};
+    Reduction<int8_t> t = reduce(mbed::Span<const int8_t>(temperatures, 5));
+    TEST_ASSERT_EQUAL(0, t.argMin);
+    TEST_ASSERT_EQUAL(0, t.argMax);
+}
+
+void test_reduce_odd_count() {
+    // The extremes in the value left over after the pairs
+    const uint16_t voltages[] = {3800, 3810, 3820, 3830, 3840, 3850, 4000};
+    Reduction<uint16_t> r = reduce(mbed::Span<const uint16_t>(voltages, 7));
+    TEST_ASSERT_EQUAL(4000, r.max);
+    TEST_ASSERT_EQUAL(6, r.argMax);
+    TEST_ASSERT_EQUAL(3800, r.min);
+    TEST_ASSERT_EQUAL(0, r.argMin);
+    TEST_ASSERT_EQUAL(7, r.count);
+    TEST_ASSERT_EQUAL(3800 + 3810 + 3820 + 3830 + 3840 + 3850 + 4000, r.sum);
+
+    // And in the three left over after the quads
+    const int8_t temperatures[] = {20, 21, 22, 23, 24, 25, 26, -5, 40, 30, 31};
+    Reduction<int8_t> t = reduce(mbed::Span<const int8_t>(temperatures, 11));
+    TEST_ASSERT_EQUAL(-5, t.min);
+    TEST_ASSERT_EQUAL(7, t.argMin);
+    TEST_ASSERT_EQUAL(40, t.max);
+    TEST_ASSERT_EQUAL(8, t.argMax);
+    TEST_ASSERT_EQUAL(11, t.count);
+}
+
+void test_reduce_temperature_sentinels() {
+    const int8_t temperatures[] = {kTempBelowRange, 20, kTempAboveRange, 10, 30, kTempAboveRange};
+    Reduction<int8_t> t = reduce(mbed::Span<const int8_t>(temperatures, 6));
+    TEST_ASSERT_EQUAL(10, t.min);
+    TEST_ASSERT_EQUAL(3, t.argMin);
+    TEST_ASSERT_EQUAL(30, t.max);
+    TEST_ASSERT_EQUAL(4, t.argMax);
+    TEST_ASSERT_EQUAL(3, t.count);
+    TEST_ASSERT_EQUAL(60, t.sum);
+    TEST_ASSERT_EQUAL(20, t.average());
+
+    // Nothing but sentinels leaves nothing to average
+    const int8_t open[] = {kTempBelowRange, kTempBelowRange, kTempAboveRange};
+    t = reduce(mbed::Span<const int8_t>(open, 3));
+    TEST_ASSERT_EQUAL(0, t.count);
+    TEST_ASSERT_EQUAL(0, t.average());
+}
+
+void test_reduce_skipped_banks() {
+    PackSnapshot snapshot;
+    snapshot.cellVoltages.fill(3800);
+    snapshot.cellTemperatures.fill(25);
+    // Extremes on a bank that wasn't read
+    snapshot.cellVoltages[kPackTopology.cellOffset(1)] = 0;
+    snapshot.cellVoltages[kPackTopology.cellOffset(1) + 1] = 4300;
+    snapshot.cellTemperatures[kPackTopology.thermistorOffset(1)] = 90;
+    // And the same lowest value on two read banks
+    snapshot.cellVoltages[kPackTopology.cellOffset(2) + 2] = 3600;
+    snapshot.cellVoltages[kPackTopology.cellOffset(3)] = 3600;
+    snapshot.cellVoltages[kPackTopology.cellOffset(4) + 1] = 3900;
+    snapshot.cellTemperatures[kPackTopology.thermistorOffset(3) + 1] = kTempBelowRange;
+
+    Reduction<uint16_t> r = reduceCellVoltages(snapshot, 1u << 1);
+    TEST_ASSERT_EQUAL(3600, r.min);
+    TEST_ASSERT_EQUAL(kPackTopology.cellOffset(2) + 2, r.argMin);
+    TEST_ASSERT_EQUAL(3900, r.max);
+    TEST_ASSERT_EQUAL(kPackTopology.cellOffset(4) + 1, r.argMax);
+    TEST_ASSERT_EQUAL(BMS_CELL_COUNT - kPackTopology.cellCount(1), r.count);
+
+    Reduction<int8_t> t = reduceTemperatures(snapshot, 1u << 1);
+    TEST_ASSERT_EQUAL(25, t.max);
+    TEST_ASSERT_EQUAL(0, t.argMax);
+    TEST_ASSERT_EQUAL(BMS_TEMP_COUNT - kPackTopology.thermistorCount(1) - 1, t.count);
+
+    // With nothing skipped the whole pack counts
+    r = reduceCellVoltages(snapshot, 0);
+    TEST_ASSERT_EQUAL(0, r.min);
+    TEST_ASSERT_EQUAL(kPackTopology.cellOffset(1), r.argMin);
+    TEST_ASSERT_EQUAL(BMS_CELL_COUNT, r.count);
+
+    // Every bank stale
+    r = reduceCellVoltages(snapshot, PackSnapshot::kAllBanks);
+    TEST_ASSERT_EQUAL(0, r.count);
+}
+
+
+#endif  // _TEST_PACK_REDUCTION_H_